@@ -5,9 +5,11 @@ set -e
 # Change the current working directory to the location of the present file
 cd "$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
 
+# Usage: build.sh [BUILD_TYPE [CMAKE_ARGS...]], e.g.
+# `build.sh Release -DALLOC_PROFILE=ON` to count allocations per layer.
 rm -rf target
 mkdir target
 cd target
-cmake -DCMAKE_BUILD_TYPE=${1:-Release} ..
+cmake -DCMAKE_BUILD_TYPE=${1:-Release} "${@:2}" ..
 cmake --build .
-mv src/da_proc ../bin
+mv src/da_proc src/da_replay src/da_tracelog ../bin
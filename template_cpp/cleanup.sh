@@ -3,5 +3,6 @@
 # Change the current working directory to the location of the present file
 DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )" 
 
-rm -f "$DIR"/bin/da_proc
+rm -f "$DIR"/bin/da_proc "$DIR"/bin/da_replay \
+      "$DIR"/bin/da_tracelog
 rm -rf "$DIR"/target
@@ -1,24 +1,21 @@
 #pragma once
 
+#include "alloc_profile.hpp"
 #include "broadcast_proxy.hpp"
+#include "mpsc_queue.hpp"
 #include "parser.hpp"
 #include "serde.hpp"
+#include "set_codec.hpp"
+#include "stats.hpp"
+#include "tracelog.hpp"
 
-#include <iostream>
+#include <algorithm>
+#include <exception>
+#include <future>
 #include <set>
+#include <stdexcept>
 #include <vector>
 
-static inline std::ostream &operator<<(std::ostream &os,
-                                       const std::set<u32> &set) {
-    os << "{ ";
-    for (auto u : set) {
-        os << u << ", ";
-    }
-    os << "}";
-
-    return os;
-}
-
 class Agreement {
   public:
     enum Type {
@@ -28,115 +25,63 @@ class Agreement {
     };
 
     using Callback = std::function<void(u32, const std::set<u32> &)>;
-    struct Payload {
+
+    // Proposal, ACK or NACK for a single agreement instance. Values are kept
+    // sorted in a flat array, which is how they are decoded off the wire.
+    struct Update {
         u32 lattice_idx;
         u32 proposalNumber;
-        std::set<u32> proposedValue;
+        std::vector<u32> proposedValue;
+    };
+
+    // Updates for many instances travel together, so that the link and URB
+    // headers are paid once per destination and loop iteration. `decisions`
+    // announce decided values, and only travel point to point.
+    struct Payload {
+        std::vector<Update> updates;
+        std::vector<Update> decisions;
     };
     using BP = BroadcastProxy<Payload>;
 
-    Agreement(const Host &host, size_t proposals)
-        : broadcast_(host), states_(proposals) {
+    const static size_t MAX_PAYLOAD_SIZE = UDP_PACKET_MAX_SIZE - 64;
+
+    // With `--announce-decisions`, a process that decides tells the others
+    // the value. A proposer still running rounds for that instance adopts it
+    // as soon as it contains everything the proposer has seen so far.
+    Agreement(const Host &host, size_t proposals,
+              size_t peerBudget = BP::_Proxy::DEFAULT_PEER_BUDGET)
+        : broadcast_(host, peerBudget),
+          announce_(config.hasOption("announce-decisions")),
+          states_(proposals), replies_(config.hosts().size()),
+          decisions_(config.hosts().size()) {
         broadcast_.setBroadcastCallback([&](const BP::Message &p) {
-            const auto &msg = p.content.payload;
-            auto &state = states_[msg.lattice_idx];
-
-#ifdef LOGGING
-            std::cout << "[" << p.content.order << ", " << p.content.host
-                      << "] Received proposal " << msg.proposalNumber << " ("
-                      << msg.proposedValue << ")" << std::endl;
-#endif
-
-            bool contained = true;
-            for (auto &v : state.acceptedValue_) {
-                if (msg.proposedValue.count(v) == 0) {
-                    contained = false;
-                    break;
-                }
-            }
-
-#ifdef LOGGING
-            std::cout << "[" << p.content.order << ", " << p.content.host
-                      << "] " << acceptedValue_ << " ⊆ " << msg.proposedValue
-                      << ": " << (contained ? "true" : "false") << std::endl;
-#endif
-
-            if (contained) {
-                state.acceptedValue_ = msg.proposedValue;
-#ifdef LOGGING
-                std::cout << "[" << p.content.order << ", " << p.content.host
-                          << "] Updating accepted value to " << acceptedValue_
-                          << std::endl;
-#endif
-
-                Payload toSend = {msg.lattice_idx, msg.proposalNumber, {}};
-#ifdef LOGGING
-                std::cout << "[" << p.content.order << ", " << p.content.host
-                          << "] Responding with ACK" << std::endl;
-#endif
-                broadcast_.send(toSend, config.host(p.content.host));
-            } else {
-                for (auto v : msg.proposedValue) {
-                    state.acceptedValue_.insert(v);
-                }
-#ifdef LOGGING
-                std::cout << "[" << p.content.order << ", " << p.content.host
-                          << "] Updating accepted value to " << acceptedValue_
-                          << std::endl;
-#endif
-
-#ifdef LOGGING
-                std::cout << "[" << p.content.order << ", " << p.content.host
-                          << "] Responding with NACK (" << acceptedValue_ << ")"
-                          << std::endl;
-#endif
-
-                Payload toSend = {msg.lattice_idx, state.activeProposalNumber_,
-                                  state.acceptedValue_};
-                broadcast_.send(toSend, config.host(p.content.host));
+            AllocScope scope(AllocTag::LATTICE);
+            for (const auto &msg : p.content.payload.updates) {
+                handleProposal(msg, p.content.host, p.content.order);
             }
-
-            checkRebroadcast(msg.lattice_idx);
-            checkTrigger(msg.lattice_idx);
         });
 
-        broadcast_.setP2PCallback([&](const BP::Message &p, const Host &
-#ifdef LOGGING
-                                                                host
-#endif
-
-                                  ) {
-            // Messages received through P2P are always acks.
-            const auto &msg = p.content.payload;
-            auto &state = states_[msg.lattice_idx];
-
-#ifdef LOGGING
-            std::cout << "Received "
-                      << (msg.proposedValue.empty() ? "ACK" : "NACK")
-                      << " from host " << host.id << " for proposal "
-                      << msg.proposalNumber << " (" << msg.proposedValue << ")"
-                      << std::endl;
-#endif
-
-            if (msg.proposalNumber != state.activeProposalNumber_) {
-                return;
+        broadcast_.setP2PCallback([&](const BP::Message &p, const Host &host) {
+            AllocScope scope(AllocTag::LATTICE);
+            for (const auto &msg : p.content.payload.updates) {
+                handleReply(msg, host);
             }
-
-            if (msg.proposedValue.empty()) {
-                state.ackCount_++;
-            } else {
-                for (const auto &it : msg.proposedValue) {
-                    state.proposedValue_.insert(it);
-                }
-                state.nackCount_++;
+            for (const auto &msg : p.content.payload.decisions) {
+                handleDecision(msg, host);
             }
-
-            checkRebroadcast(msg.lattice_idx);
-            checkTrigger(msg.lattice_idx);
         });
+
+        broadcast_.setTickCallback([&]() { flush(); });
     }
 
+    // Only safe on the thread running the event loop, e.g. before wait().
+    // Each of the `proposals` instances is proposed at most once: later
+    // proposals for it are ignored.
     void propose(const std::set<u32> &proposal, u32 lattice_idx) {
+        AllocScope scope(AllocTag::LATTICE);
+        if (lattice_idx >= states_.size() || proposed(states_[lattice_idx])) {
+            return;
+        }
         auto &state = states_[lattice_idx];
 
         state.proposedValue_ = proposal;
@@ -145,15 +90,27 @@ class Agreement {
         state.ackCount_ = 0;
         state.nackCount_ = 0;
 
-        Payload p = {lattice_idx, state.activeProposalNumber_,
-                     state.proposedValue_};
+        Update p = {lattice_idx, state.activeProposalNumber_,
+                    {state.proposedValue_.begin(), state.proposedValue_.end()}};
+        trace(TraceEvent::PROPOSE, lattice_idx, p.proposalNumber,
+              static_cast<u32>(p.proposedValue.size()));
 
-#ifdef LOGGING
-        std::cout << "Broadcasting " << p.proposalNumber << " ("
-                  << p.proposedValue << ")" << std::endl;
-#endif
+        proposals_.push_back(p);
+    }
 
-        broadcast_.broadcast(p);
+    // Safe from any thread, and never waits on the event loop, which admits
+    // the proposal on its next iteration. The future is fulfilled with the
+    // decided value, right after the callback has run. It fails with
+    // std::out_of_range for an index past `proposals`, and with
+    // std::invalid_argument for an instance already proposed but undecided;
+    // an instance already decided fulfils it with its value right away.
+    std::future<std::set<u32>> submit(std::set<u32> proposal,
+                                      u32 lattice_idx) {
+        AllocScope scope(AllocTag::LATTICE);
+        Submission s = {lattice_idx, std::move(proposal), {}};
+        auto decided = s.decided.get_future();
+        submissions_.push(std::move(s));
+        return decided;
     }
 
     void setCallback(Callback cb) { cb_ = cb; }
@@ -163,17 +120,181 @@ class Agreement {
   private:
     BP broadcast_;
     Callback cb_;
+    bool announce_;
 
     struct State {
         bool active_ = false;
+        bool decided_ = false;
         u32 ackCount_ = 0;
         u32 nackCount_ = 0;
         u32 activeProposalNumber_ = 0;
         std::set<u32> proposedValue_ = {};
         std::set<u32> acceptedValue_ = {};
+        std::vector<std::promise<std::set<u32>>> waiters_ = {};
     };
     std::vector<State> states_;
 
+    struct Submission {
+        u32 lattice_idx;
+        std::set<u32> proposal;
+        std::promise<std::set<u32>> decided;
+    };
+    MpscQueue<Submission> submissions_;
+
+    static bool proposed(const State &state) {
+        return state.active_ || state.decided_;
+    }
+
+    std::vector<Update> proposals_;
+    std::vector<std::vector<Update>> replies_;
+    std::vector<std::vector<Update>> decisions_;
+
+    // Instances are numbered from the configuration, which every process
+    // shares: updates for any other index are ignored.
+    void handleProposal(const Update &msg, u32 host, u32 order) {
+        if (msg.lattice_idx >= states_.size()) {
+            return;
+        }
+        auto &state = states_[msg.lattice_idx];
+        trace(TraceEvent::PROPOSAL_RECEIVED, msg.lattice_idx,
+              msg.proposalNumber, host, order,
+              static_cast<u32>(msg.proposedValue.size()));
+
+        const auto &proposed = msg.proposedValue;
+        bool contained =
+            std::includes(proposed.begin(), proposed.end(),
+                          state.acceptedValue_.begin(),
+                          state.acceptedValue_.end());
+
+        if (contained) {
+            state.acceptedValue_ = {proposed.begin(), proposed.end()};
+
+            trace(TraceEvent::ACK_SENT, msg.lattice_idx, msg.proposalNumber,
+                  host);
+            replies_[host - 1].push_back(
+                {msg.lattice_idx, msg.proposalNumber, {}});
+        } else {
+            state.acceptedValue_.insert(proposed.begin(), proposed.end());
+
+            // Answers the proposal it received: this process' own proposal
+            // number only matches while every proposer is in lockstep.
+            trace(TraceEvent::NACK_SENT, msg.lattice_idx, msg.proposalNumber,
+                  host, static_cast<u32>(state.acceptedValue_.size()));
+            replies_[host - 1].push_back(
+                {msg.lattice_idx,
+                 msg.proposalNumber,
+                 {state.acceptedValue_.begin(), state.acceptedValue_.end()}});
+        }
+
+        checkRebroadcast(msg.lattice_idx);
+        checkTrigger(msg.lattice_idx);
+    }
+
+    void handleReply(const Update &msg, const Host &host) {
+        // Messages received through P2P are always acks.
+        if (msg.lattice_idx >= states_.size()) {
+            return;
+        }
+        auto &state = states_[msg.lattice_idx];
+
+        if (msg.proposedValue.empty()) {
+            trace(TraceEvent::ACK_RECEIVED, msg.lattice_idx, msg.proposalNumber,
+                  static_cast<u32>(host.id));
+        } else {
+            trace(TraceEvent::NACK_RECEIVED, msg.lattice_idx,
+                  msg.proposalNumber, static_cast<u32>(host.id),
+                  static_cast<u32>(msg.proposedValue.size()));
+        }
+
+        if (msg.proposalNumber != state.activeProposalNumber_) {
+            return;
+        }
+
+        if (msg.proposedValue.empty()) {
+            state.ackCount_++;
+        } else {
+            state.proposedValue_.insert(msg.proposedValue.begin(),
+                                        msg.proposedValue.end());
+            state.nackCount_++;
+        }
+
+        checkRebroadcast(msg.lattice_idx);
+        checkTrigger(msg.lattice_idx);
+    }
+
+    // Another process decided the announced value, so it is comparable with
+    // every other decision; it is a valid decision here too as long as it
+    // contains this process' proposal.
+    void handleDecision(const Update &msg, const Host &host) {
+        if (msg.lattice_idx >= states_.size()) {
+            return;
+        }
+        auto &state = states_[msg.lattice_idx];
+        const auto &decided = msg.proposedValue;
+
+        if (!state.active_ ||
+            !std::includes(decided.begin(), decided.end(),
+                           state.proposedValue_.begin(),
+                           state.proposedValue_.end())) {
+            return;
+        }
+
+        state.proposedValue_ = {decided.begin(), decided.end()};
+        trace(TraceEvent::DECISION_ADOPTED, msg.lattice_idx,
+              state.activeProposalNumber_, static_cast<u32>(host.id),
+              static_cast<u32>(decided.size()));
+        decide(msg.lattice_idx);
+    }
+
+    // Sends `updates` as the `field` of as few payloads as fit in a datagram.
+    template <typename F>
+    void flushUpdates(std::vector<Update> &updates,
+                      std::vector<Update> Payload::*field, F send);
+
+    void flush() {
+        AllocScope scope(AllocTag::LATTICE);
+        submissions_.drain([&](Submission &s) {
+            if (s.lattice_idx >= states_.size()) {
+                s.decided.set_exception(std::make_exception_ptr(
+                    std::out_of_range("No such agreement instance")));
+                return;
+            }
+
+            auto &state = states_[s.lattice_idx];
+            if (state.decided_) {
+                s.decided.set_value(state.proposedValue_);
+                return;
+            }
+            if (state.active_) {
+                s.decided.set_exception(
+                    std::make_exception_ptr(std::invalid_argument(
+                        "Agreement instance already proposed")));
+                return;
+            }
+
+            propose(s.proposal, s.lattice_idx);
+            state.waiters_.push_back(std::move(s.decided));
+        });
+
+        if (!proposals_.empty()) {
+            flushUpdates(proposals_, &Payload::updates,
+                         [&](const Payload &p) { broadcast_.broadcast(p); });
+            broadcast_.flush();
+        }
+
+        for (size_t i = 0; i < replies_.size(); ++i) {
+            const Host &host = config.host(i + 1);
+            auto send = [&](const Payload &p) { broadcast_.send(p, host); };
+
+            if (!replies_[i].empty()) {
+                flushUpdates(replies_[i], &Payload::updates, send);
+            }
+            if (!decisions_[i].empty()) {
+                flushUpdates(decisions_[i], &Payload::decisions, send);
+            }
+        }
+    }
+
     void checkRebroadcast(u32 lattice_idx) {
         auto &state = states_[lattice_idx];
 
@@ -185,15 +306,14 @@ class Agreement {
             state.ackCount_ = 0;
             state.nackCount_ = 0;
 
-            Payload p = {lattice_idx, state.activeProposalNumber_,
-                         state.proposedValue_};
-
-#ifdef LOGGING
-            std::cout << "Broadcasting " << p.proposalNumber << " ("
-                      << p.proposedValue << ")" << std::endl;
-#endif
+            Update p = {
+                lattice_idx,
+                state.activeProposalNumber_,
+                {state.proposedValue_.begin(), state.proposedValue_.end()}};
+            trace(TraceEvent::PROPOSE, lattice_idx, p.proposalNumber,
+                  static_cast<u32>(p.proposedValue.size()));
 
-            broadcast_.broadcast(p);
+            proposals_.push_back(p);
         }
     }
 
@@ -203,66 +323,180 @@ class Agreement {
         if (state.active_ &&
             static_cast<float>(state.ackCount_) >= config.f() + 1 &&
             state.active_) {
-            state.active_ = false;
+            trace(TraceEvent::DECIDE, lattice_idx,
+                  state.activeProposalNumber_,
+                  static_cast<u32>(state.proposedValue_.size()));
+            decide(lattice_idx);
+
+            if (announce_) {
+                announce(lattice_idx);
+            }
+        }
+    }
+
+    void decide(u32 lattice_idx) {
+        auto &state = states_[lattice_idx];
+
+        state.active_ = false;
+        state.decided_ = true;
+        stats.decided++;
+        if (cb_) {
             cb_(lattice_idx, state.proposedValue_);
         }
+
+        for (auto &waiter : state.waiters_) {
+            waiter.set_value(state.proposedValue_);
+        }
+        state.waiters_.clear();
+    }
+
+    void announce(u32 lattice_idx) {
+        const auto &state = states_[lattice_idx];
+        Update d = {lattice_idx,
+                    state.activeProposalNumber_,
+                    {state.proposedValue_.begin(), state.proposedValue_.end()}};
+
+        for (size_t i = 0; i < decisions_.size(); ++i) {
+            if (i + 1 != config.id()) {
+                decisions_[i].push_back(d);
+            }
+        }
     }
 };
 
-static inline u8 *ser(const Agreement::Payload &p, u8 *buff, size_t &s) {
+static inline u8 *ser(const Agreement::Update &p, u8 *buff, size_t &s) {
+    u8 *start = buff;
+
     buff = write_u32(buff, p.proposalNumber);
     buff = write_u32(buff, p.lattice_idx);
-    buff = write_u32(buff, static_cast<u32>(p.proposedValue.size()));
-
-    for (auto &v : p.proposedValue) {
-        buff = write_u32(buff, v);
-    }
+    buff = write_set(buff, p.proposedValue);
 
-    s += sizeof(u32) * (p.proposedValue.size() + 3);
+    s += static_cast<size_t>(buff - start);
 
     return buff;
 }
 
-static inline u8 *deserialize(Agreement::Payload &p, u8 *buff, size_t &s) {
+static inline size_t serSize(const Agreement::Update &p) {
+    return sizeof(u32) * 2 + set_size(p.proposedValue);
+}
+
+static inline u8 *deserialize(Agreement::Update &p, u8 *buff, const u8 *end,
+                              size_t &s) {
+    if (remaining(buff, end) < sizeof(u32) * 2) {
+        return nullptr;
+    }
     buff = read_u32(buff, p.proposalNumber);
     buff = read_u32(buff, p.lattice_idx);
+    buff = read_set(buff, end, p.proposedValue, s);
+    if (buff == nullptr) {
+        return nullptr;
+    }
 
-    u32 size;
-    buff = read_u32(buff, size);
+    s += sizeof(u32) * 2;
+
+    return buff;
+}
 
-    for (u32 i = 0; i < size; i++) {
-        u32 v;
-        buff = read_u32(buff, v);
-        p.proposedValue.insert(v);
+static inline u8 *ser(const std::vector<Agreement::Update> &updates, u8 *buff,
+                      size_t &s) {
+    s += sizeof(u32);
+    buff = write_u32(buff, static_cast<u32>(updates.size()));
+
+    for (auto &u : updates) {
+        buff = ser(u, buff, s);
+    }
+
+    return buff;
+}
+
+static inline size_t serSize(const std::vector<Agreement::Update> &updates) {
+    size_t size = sizeof(u32);
+    for (auto &u : updates) {
+        size += serSize(u);
+    }
+    return size;
+}
+
+static inline u8 *deserialize(std::vector<Agreement::Update> &updates,
+                              u8 *buff, const u8 *end, size_t &s) {
+    if (remaining(buff, end) < sizeof(u32)) {
+        return nullptr;
     }
+    s += sizeof(u32);
 
-    s += sizeof(u32) * (size + 3);
+    u32 count;
+    buff = read_u32(buff, count);
+
+    // An empty update still takes its two numbers and the set header.
+    if (count > remaining(buff, end) / (sizeof(u32) * 2 + SET_META_SIZE)) {
+        return nullptr;
+    }
+
+    updates.resize(count);
+    for (auto &u : updates) {
+        buff = deserialize(u, buff, end, s);
+        if (buff == nullptr) {
+            return nullptr;
+        }
+    }
 
     return buff;
 }
 
-static inline u8 *
-ser(const typename BroadcastProxy<Agreement::Payload>::Payload &p, u8 *buff,
-    size_t &s) {
-    s += 9;
-    buff = write_byte(buff, static_cast<u8>(p.isBroadcasted));
-    buff = write_u32(buff, p.host);
-    if (buff[3] == 18)
-        abort();
-    buff = write_u32(buff, p.order);
-    return ser(p.payload, buff, s);
+static inline u8 *ser(const Agreement::Payload &p, u8 *buff, size_t &s) {
+    buff = ser(p.updates, buff, s);
+    return ser(p.decisions, buff, s);
+}
+
+static inline size_t serSize(const Agreement::Payload &p) {
+    return serSize(p.updates) + serSize(p.decisions);
+}
+
+// A newer proposal for an instance makes the older ones from the same
+// proposer obsolete: their replies would be ignored anyway.
+static inline void supersedeKeys(const Agreement::Payload &p,
+                                 std::vector<u32> &keys) {
+    for (auto &u : p.updates) {
+        keys.push_back(u.lattice_idx);
+    }
+}
+
+static inline void chargeWire(const Agreement::Payload *, size_t size,
+                              u64 *bytes) {
+    layerBytes(bytes, Layer::LATTICE) += size;
 }
 
-static inline u8 *
-deserialize(typename BroadcastProxy<Agreement::Payload>::Payload &p, u8 *buff,
-            size_t &s) {
-    s += 9;
+static inline u8 *deserialize(Agreement::Payload &p, u8 *buff, const u8 *end,
+                              size_t &s) {
+    buff = deserialize(p.updates, buff, end, s);
+    if (buff == nullptr) {
+        return nullptr;
+    }
+    return deserialize(p.decisions, buff, end, s);
+}
 
-    u8 isBroadcasted;
-    buff = read_byte(buff, isBroadcasted);
-    p.isBroadcasted = static_cast<bool>(isBroadcasted);
+template <typename F>
+inline void Agreement::flushUpdates(std::vector<Update> &updates,
+                                    std::vector<Update> Payload::*field,
+                                    F send) {
+    Payload p;
+    auto &batch = p.*field;
+    size_t size = 0;
+
+    for (auto &u : updates) {
+        size_t s = serSize(u);
+        if (!batch.empty() && size + s > MAX_PAYLOAD_SIZE) {
+            send(p);
+            batch.clear();
+            size = 0;
+        }
 
-    buff = read_u32(buff, p.host);
-    buff = read_u32(buff, p.order);
-    return deserialize(p.payload, buff, s);
+        batch.push_back(std::move(u));
+        size += s;
+    }
+
+    if (!batch.empty()) {
+        send(p);
+    }
+    updates.clear();
 }
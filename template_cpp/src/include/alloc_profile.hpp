@@ -0,0 +1,50 @@
+#pragma once
+
+#include "serde.hpp"
+
+#include <cstdint>
+
+// Layers of the stack that heap allocations are charged to.
+enum class AllocTag : uint8_t { OTHER, LINK, URB, FIFO, LATTICE, APP, COUNT };
+
+struct AllocCounters {
+    u64 allocations;
+    u64 bytes;
+    u64 peakBytes;
+};
+
+const char *allocTagName(AllocTag tag);
+
+// Built with `-DALLOC_PROFILE=ON`, global operator new and delete count every
+// allocation, and the bytes it keeps live, against the tag of the innermost
+// AllocScope of the allocating thread. Frees are charged to the tag the
+// memory was allocated under. Otherwise scopes compile to nothing and
+// allocProfiled() is false.
+#ifdef ALLOC_PROFILE
+
+class AllocScope {
+  public:
+    explicit AllocScope(AllocTag tag);
+    ~AllocScope();
+
+    AllocScope(const AllocScope &) = delete;
+    AllocScope &operator=(const AllocScope &) = delete;
+
+  private:
+    AllocTag previous_;
+};
+
+inline bool allocProfiled() { return true; }
+
+#else
+
+class AllocScope {
+  public:
+    explicit AllocScope(AllocTag) {}
+};
+
+inline bool allocProfiled() { return false; }
+
+#endif
+
+AllocCounters allocCounters(AllocTag tag);
@@ -1,10 +1,21 @@
 #pragma once
 
+#include "clock.hpp"
 #include "proxy.hpp"
 #include "serde.hpp"
 #include <cstdint>
 #include <set>
 
+// Unit of uniform reliable broadcast. Carries `payloads.size()` application
+// payloads numbered contiguously from `order`, and is acknowledged and
+// delivered as a whole.
+template <typename P> struct UrbBundle {
+    bool isBroadcasted;
+    u32 order;
+    u32 host;
+    std::vector<P> payloads;
+};
+
 template <typename P> class BroadcastProxy {
   public:
     using Payload = struct {
@@ -13,19 +24,36 @@ template <typename P> class BroadcastProxy {
         u32 host;
         P payload;
     };
-    using _Proxy = Proxy<Payload>;
-    using Message = typename _Proxy::Message;
+    using Bundle = UrbBundle<P>;
+    using _Proxy = Proxy<Bundle>;
+
+    struct Message {
+        Payload content;
+    };
+
+    const static size_t BUNDLE_META_SIZE = 13;
+    const static size_t DEFAULT_BUNDLE_SIZE = 64;
 
-    BroadcastProxy(const Host &host);
+    BroadcastProxy(const Host &host,
+                   size_t peerBudget = _Proxy::DEFAULT_PEER_BUDGET);
 
     using BroadcastCallback = std::function<void(const Message &)>;
     using P2PCallback = std::function<void(const Message &, const Host &)>;
 
     void setBroadcastCallback(BroadcastCallback cb) { broadcastCallback_ = cb; }
     void setP2PCallback(P2PCallback cb) { p2pCallback_ = cb; }
+    void setTickCallback(typename _Proxy::TickCallback cb) {
+        tickCallback_ = cb;
+    }
+
+    // Payloads are queued until `maxSize` of them are pending, or until the
+    // oldest one has waited for `latency`. A zero latency flushes on the next
+    // iteration of the event loop.
+    void setBundling(size_t maxSize, Clock::duration latency);
 
     void broadcast(const std::vector<P> &payload);
     void broadcast(const P &payload);
+    void flush();
 
     void send(const P &payload, const Host &host);
 
@@ -35,14 +63,33 @@ template <typename P> class BroadcastProxy {
   private:
     _Proxy proxy_;
 
+    void enqueue(const P &payload);
+    void deliver(const Bundle &bundle);
+
+    // Done with a bundle, delivered or given up on. Its payloads stay pending
+    // while some link needs them to encode it again.
+    void forget(u64 msg_id);
+
+    // Tags a bundle with the supersede keys of its payloads, scoped to the
+    // bundle's origin, so that newer bundles from the same origin replace it.
+    std::vector<typename _Proxy::Tag> tags(const Bundle &bundle);
+
     std::map<u64, std::vector<bool>> ack_;
-    std::map<u64, Payload> pending_;
+    std::map<u64, Bundle> pending_;
     std::set<u64> delivered_;
 
     BroadcastCallback broadcastCallback_;
     P2PCallback p2pCallback_;
+    typename _Proxy::TickCallback tickCallback_;
 
     uint32_t order_;
+
+    std::vector<P> outgoing_;
+    size_t outgoingBytes_;
+    Clock::time_point outgoingSince_;
+
+    size_t bundleSize_;
+    Clock::duration flushLatency_;
 };
 
 #include "../src/broadcast_proxy.tpp"
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <chrono>
+
+// Clock driving the protocol timers. It follows the monotonic clock, except
+// while a trace is replayed: it is then pinned to the receive time of the
+// datagram being processed, so that retransmissions and flushes fire at the
+// same points of the input on every run.
+struct Clock {
+    using duration = std::chrono::nanoseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<Clock>;
+    static const bool is_steady = true;
+
+    static time_point now();
+
+    static void pin(time_point t);
+
+  private:
+    static bool pinned_;
+    static time_point time_;
+};
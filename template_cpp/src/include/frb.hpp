@@ -2,7 +2,7 @@
 
 #include "serde.hpp"
 #include <broadcast_proxy.hpp>
-#include <map>
+#include <reorder_window.hpp>
 #include <vector>
 
 template <typename Payload> class FifoProxy {
@@ -10,11 +10,18 @@ template <typename Payload> class FifoProxy {
     using _BroadcastProxy = BroadcastProxy<Payload>;
     using Message = typename _BroadcastProxy::Message;
 
-    FifoProxy(const Host &host);
+    FifoProxy(const Host &host,
+              size_t peerBudget = _BroadcastProxy::_Proxy::DEFAULT_PEER_BUDGET);
 
     using Callback = std::function<void(const Message &msg)>;
 
     void setCallback(Callback cb) { callback_ = cb; }
+    void setTickCallback(typename _BroadcastProxy::_Proxy::TickCallback cb) {
+        proxy_.setTickCallback(cb);
+    }
+    void setBundling(size_t maxSize, Clock::duration latency) {
+        proxy_.setBundling(maxSize, latency);
+    }
 
     void broadcast(const std::vector<Payload> &payloads);
     void broadcast(const Payload &payload);
@@ -24,15 +31,9 @@ template <typename Payload> class FifoProxy {
   private:
     _BroadcastProxy proxy_;
 
-    struct ToDeliver {
-        u32 order;
-        Message msg;
-    };
-
     Callback callback_;
 
-    std::vector<std::map<u32, Message>> received_;
-    std::vector<u32> delivered_;
+    std::vector<ReorderWindow<Message>> received_;
 };
 
 #include "../src/frb.tpp"
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+
+// Unbounded lock-free queue with any number of producers and a single
+// consumer. Producers link a node in with one atomic exchange and never wait
+// on the consumer; the consumer only sees a node once its producer has
+// finished linking it.
+template <typename T> class MpscQueue {
+  public:
+    MpscQueue();
+    ~MpscQueue();
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    // Safe to call from any thread.
+    void push(T value);
+
+    // Calls `f` on every value pushed so far, in order. Only the consumer
+    // thread may call it.
+    template <typename F> void drain(F &&f);
+
+  private:
+    struct Node {
+        std::atomic<Node *> next{nullptr};
+        T value;
+    };
+
+    std::atomic<Node *> head_;
+    Node *tail_;
+};
+
+#include "../src/mpsc_queue.tpp"
@@ -11,6 +11,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <host.hpp>
+#include <map>
 #include <serde.hpp>
 #include <set>
 #include <string>
@@ -20,6 +21,8 @@ class Parser {
    public:
     Parser() {}
 
+    enum class Mode { PERFECT_LINKS, FIFO_BROADCAST, LATTICE_AGREEMENT };
+
     struct ConfigEntry {
         size_t id;
         size_t count;
@@ -34,6 +37,8 @@ class Parser {
         }
     }
 
+    Mode mode() const { return mode_; }
+    u32 messages() const { return messages_; }
     unsigned long receiverId() const { return receiverId_; }
     unsigned long id() const { return id_; }
 
@@ -57,6 +62,17 @@ class Parser {
 
     const std::vector<std::set<u32>>& proposals() const { return proposals_; }
 
+    // Optional `--name [value]` arguments given after CONFIG, among the ones
+    // listed in parser.cpp.
+    bool hasOption(const std::string &name) const {
+        return options_.count(name) > 0;
+    }
+    std::string option(const std::string &name,
+                       const std::string &fallback = "") const {
+        auto it = options_.find(name);
+        return it == options_.end() ? fallback : it->second;
+    }
+
    private:
     bool parseInternal();
 
@@ -70,6 +86,7 @@ class Parser {
 
     bool parseOutputPath();
     bool parseConfigPath();
+    bool parseOptions();
     bool isPositiveNumber(const std::string &s) const;
 
     void ltrim(std::string &s);
@@ -80,6 +97,8 @@ class Parser {
     int argc_;
     char **argv_;
 
+    Mode mode_;
+    u32 messages_;
     unsigned long receiverId_;
     unsigned long id_;
     std::string hostsPath_;
@@ -87,6 +106,7 @@ class Parser {
     std::string configPath_;
 
     std::vector<std::set<u32>> proposals_;
+    std::map<std::string, std::string> options_;
 
     std::vector<Host> hosts_;
     std::vector<ConfigEntry> entries_;
@@ -1,14 +1,17 @@
 #pragma once
 
+#include <clock.hpp>
 #include <parser.hpp>
+#include <seq_ring.hpp>
+#include <seq_window.hpp>
 #include <serde.hpp>
 #include <udp.hpp>
 
-#include <chrono>
 #include <cstddef>
+#include <deque>
 #include <functional>
 #include <map>
-#include <set>
+#include <unordered_map>
 #include <vector>
 
 template <typename Payload> class Proxy {
@@ -18,55 +21,309 @@ template <typename Payload> class Proxy {
         Payload content;
     };
 
-    Proxy(const Host &host);
+    const static size_t MSG_META_SIZE = 5;
+    const static size_t DEFAULT_PEER_BUDGET = 16 << 20;
+
+    // Bodies longer than FRAGMENT_SIZE are split into fragments of exactly
+    // that size, except for the last one, each sent, acked and retransmitted
+    // under its own seq. A fragment record adds the body length and the
+    // fragment's offset in it to the usual link header.
+    //
+    // The fragments in flight to each host are bounded by a window: a share
+    // of the socket buffers, presumed sized like its own, for each host, so
+    // that those from all of its peers fit with room to spare. The others are
+    // queued, and sent as the earlier ones get acked, which the receiver does
+    // at once rather than after ACK_DELAY.
+    const static size_t FRAG_META_SIZE = MSG_META_SIZE + 2 * sizeof(u32);
+    const static size_t FRAGMENT_SIZE = 60 * 1024;
+
+    // Fragments of bodies longer than this are dropped by the receiver.
+    const static size_t MAX_BODY_SIZE = 64 << 20;
+
+    // At most MAX_SPAN seqs, from the oldest unacknowledged one, are in
+    // flight to each host: as many as its SeqWindow can accept. Messages
+    // past it wait in a backlog, with their seqs already given, until acks
+    // make room.
+    const static u32 MAX_SPAN = 1 << 16;
+
+    static size_t fragmentLength(size_t total, size_t offset) {
+        return total - offset < FRAGMENT_SIZE ? total - offset : FRAGMENT_SIZE;
+    }
+
+    Proxy(const Host &host, size_t budget = DEFAULT_PEER_BUDGET);
     ~Proxy();
 
     void send(const Payload &p, const Host &host);
-    void send(const Payload &p, u32 seq, const Host &host);
     void send(const std::vector<Payload> &payloads, const Host &host);
 
+    // Sends `p` to each of `hosts`, encoding it only once.
+    //
+    // Messages sharing a tag key supersede each other: once every key of an
+    // unacknowledged message has been reused by a message with a higher
+    // version, its content is dropped and only its seq is retransmitted. The
+    // keys of a message must be distinct.
+    //
+    // The bodies held for a host until it acks them are bounded by the budget
+    // the proxy is built with. Past it, the oldest ones sent with a non-zero
+    // `ref` that the source still has are dropped, and encoded again from it
+    // whenever they go out. Nothing else is dropped while the host is alive:
+    // new messages wait in its backlog until acks bring the bytes in flight
+    // back within the budget. Only once the host has gone silent are the
+    // others evicted, the same way as superseded ones, and lost to it.
+    struct Tag {
+        u64 key;
+        u32 version;
+    };
+    void send(const Payload &p, const std::vector<Host> &hosts,
+              const std::vector<Tag> &tags, u64 ref = 0);
+
     using Callback = std::function<void(Message &message, const Host &host)>;
     void setCallback(Callback cb) { callback_ = cb; }
 
+    // Invoked with the non-zero `ref` a message was sent with whenever one of
+    // its hosts will not get its content, superseded or evicted.
+    using DroppedCallback = std::function<void(u64 ref)>;
+    void setDroppedCallback(DroppedCallback cb) { droppedCallback_ = cb; }
+
+    // Where bodies dropped past a budget are encoded again from. `source`
+    // must keep returning the payload sent with `ref` as long as compacted()
+    // holds for it, and `release` is invoked once it no longer does.
+    using Source = std::function<const Payload *(u64 ref)>;
+    using Release = std::function<void(u64 ref)>;
+    void setSource(Source source, Release release) {
+        source_ = source;
+        release_ = release;
+    }
+    bool compacted(u64 ref) const { return compacted_.count(ref) > 0; }
+
+    // Invoked on every iteration of the event loop.
+    using TickCallback = std::function<void()>;
+    void setTickCallback(TickCallback cb) { tickCallback_ = cb; }
+
+    // Runs the event loop forever; poll() runs a single iteration of it.
     void wait();
     void poll();
 
+    // Number of messages sent to `host` that it has not acknowledged yet.
+    size_t inFlight(const Host &host) const {
+        return sent_[host.id - 1].size() + peers_[host.id - 1].backlog.size();
+    }
+
+    // Number of messages from `host` that only some fragments of were
+    // received yet.
+    size_t partials(const Host &host) const {
+        return partial_[host.id - 1].size();
+    }
+
   private:
-    struct ToSend {
-        void *message;
+    // Encoded payload, shared by the unacknowledged copies of a message sent
+    // to several hosts. The link header is written in front of it on every
+    // transmission.
+    struct Body {
+        u32 refs;
         size_t length;
-        bool acked;
+
+        u8 *data() { return reinterpret_cast<u8 *>(this + 1); }
+    };
+
+    struct ToSend {
+        u32 seq;
+        Body *body;     // nullptr once superseded, evicted or compacted
+        u32 length;     // of `body`
+        u32 offset;     // of the fragment in `body`, if it was fragmented
+        u32 round;      // retransmission round of the peer when last sent
+        bool queued;    // fragment waiting for room in the window
+        bool compacted; // `body` is to be encoded again from the source
+        bool resent;    // its ack says nothing of the round-trip time
+        u64 ref;
+        Clock::time_point sent;
+    };
+
+    static bool fragmented(const ToSend &message) {
+        return message.length > FRAGMENT_SIZE;
+    }
+
+    // Bytes of its body that a message charges to the budget of its host.
+    static size_t held(const ToSend &message) {
+        if (message.body == nullptr) {
+            return 0;
+        }
+        return fragmented(message)
+                   ? fragmentLength(message.length, message.offset)
+                   : message.length;
+    }
+
+    // Fragments received so far of a message, keyed by the seq of its first
+    // fragment. A partial is dropped once every seq up to its last fragment
+    // has been received or skipped. Each unacked fragment holds a partial
+    // open at most, so past twice the window of them per host the least
+    // recently updated ones were left behind by a sender that stopped.
+    struct Partial {
+        std::vector<u8> buffer;
+        size_t received;
+        u32 total;
+        u32 last;
+        Clock::time_point updated;
     };
+    const static size_t MAX_POOLED = 8;
 
-    struct DeliveredEntry {
-        u32 lowerBound;
-        std::set<u32> delivered;
+    // Liveness estimate and retransmission state for each destination.
+    // Retransmission rounds are `timeout` apart, estimated from the round-trip
+    // times of the messages acked at their first transmission, as TCP does,
+    // so that a peer whose loop is slow is not flooded with copies. Peers
+    // that stay silent through a round are retried after an exponentially
+    // growing delay, reset as soon as they are heard from. One still silent
+    // at MAX_BACKOFF is presumed gone.
+    struct Peer {
+        Clock::time_point lastHeard;
+        Clock::time_point lastRetransmit;
+        Clock::time_point nextRetransmit;
+        Clock::duration backoff;
+        Clock::duration timeout;
+        Clock::duration rtt;    // smoothed, zero until the first sample
+        Clock::duration rttVar; // mean deviation of the samples
+        u32 round;
+        u32 fragmentsInFlight;
+        size_t bytes;        // held by the messages in flight
+        size_t backlogBytes; // held by the messages in the backlog
+        u32 compacted;       // seqs below it hold no compactable body
+        std::deque<u32> queued;
+        std::deque<ToSend> backlog;
     };
 
     struct Ack {
         u32 seq;
     };
-    const static size_t MSG_META_SIZE = 5;
     const static size_t ACK_SIZE = sizeof(Ack) + 1;
 
-    void innerSend(const std::vector<ToSend> &payloads, const Host &host);
+    struct Tagged {
+        std::vector<u64> keys;
+        u32 live;
+    };
+
+    struct Latest {
+        u32 version;
+        u32 seq;
+    };
+
+    Body *encode(const Payload &p);
+    void unref(Body *body);
+
+    // Appends `body` to the messages unacknowledged by the host, as several
+    // fragments if need be, and returns the seq of the first one.
+    u32 store(size_t hostIdx, Body *body, u64 ref = 0);
+    void push(size_t hostIdx, const ToSend &entry);
+    u32 nextSeq(size_t hostIdx) const {
+        return sent_[hostIdx].end() +
+               static_cast<u32>(peers_[hostIdx].backlog.size());
+    }
+    ToSend *findSent(size_t hostIdx, u32 seq);
+    size_t &heldBytes(size_t hostIdx, u32 seq) {
+        return static_cast<int32_t>(seq - sent_[hostIdx].end()) >= 0
+                   ? peers_[hostIdx].backlogBytes
+                   : peers_[hostIdx].bytes;
+    }
+
+    // Moves what fits of the backlog of the host in flight, and sends it.
+    void admit(size_t hostIdx);
+    void retransmit(size_t hostIdx);
+    void checkRetransmissions();
+    void heard(size_t hostIdx);
+    void sampleRtt(size_t hostIdx, Clock::duration rtt);
+    bool silent(size_t hostIdx) const {
+        return peers_[hostIdx].backoff >= MAX_BACKOFF;
+    }
+    bool overBudget(size_t hostIdx) const {
+        return peers_[hostIdx].bytes + peers_[hostIdx].backlogBytes > budget_;
+    }
+
+    // Sends every unacknowledged message from seq `from` on, packed into as
+    // few datagrams as possible. A retransmission skips the messages sent
+    // since the previous one, which cannot be presumed lost yet, and the
+    // fragments but the oldest: the others are most likely queued behind it
+    // at a receiver too busy to ack them.
+    void innerSend(size_t hostIdx, u32 from, bool retransmission = false);
+    void transmit(size_t hostIdx, ToSend &message);
+    void releaseFragment(size_t hostIdx);
 
-    using Clock = std::chrono::system_clock;
     const Clock::duration TIMEOUT = Clock::duration(10000000); // 10ms
+    const Clock::duration MAX_TIMEOUT = Clock::duration(250000000); // 250ms
+    const Clock::duration MAX_BACKOFF = Clock::duration(1000000000); // 1s
+    const Clock::duration ACK_DELAY = Clock::duration(1000000); // 1ms
 
-    size_t serialize(const Message &msg, u8 *buff);
+    // Writes the link header and body of `message`, or a skip record standing
+    // in for it once it has been superseded or evicted.
+    size_t serialize(ToSend &message, u8 *buff);
+    static size_t recordSize(const ToSend &message);
     size_t serialize(const Ack &ack, u8 *buff);
 
-    size_t handleMessage(u8 *buff, const Host &host, u8 *acks,
-                         size_t &acksSize);
+    // Charges `length` bytes of an encoded payload `total` bytes long to the
+    // layers that wrote it, in proportion for a fragment.
+    static void chargeBody(size_t total, size_t length, u64 *bytes);
+
+    // Handles the record at `buff`, among the `available` bytes left in the
+    // datagram, and returns its size.
+    size_t handleMessage(u8 *buff, size_t available, const Host &host);
+    bool validFragment(size_t hostIdx, u32 seq, u32 total, u32 offset,
+                       size_t available);
+    void reassemble(const Host &host, u32 first, u32 total, u32 offset,
+                    const u8 *data, size_t length);
+    void expirePartials(size_t hostIdx);
+    void recycle(std::vector<u8> &buffer);
+
+    // Acks are held back for up to ACK_DELAY so that they can ride along with
+    // the next data datagram sent to the same host, unless `now`: then they
+    // go out at the end of the datagram being handled.
+    void queueAck(const Ack &ack, size_t hostIdx, bool now = false);
+    size_t appendAcks(u8 *buff, size_t size, size_t hostIdx);
+    void flushAcks();
+
+    void supersede(size_t hostIdx, u32 seq);
+    void untag(size_t hostIdx, u32 seq);
+
+    // Drops the body of `message`, which then goes out as a skip record.
+    void drop(size_t hostIdx, ToSend &message);
+
+    // Drops the oldest bodies held for the host that the source can encode
+    // again, until it is back within its budget. Toward a silent host, the
+    // others are evicted as well, but for fragments: the receiver could not
+    // tell that the rest of their message is gone.
+    void compact(size_t hostIdx);
+    void uncompact(ToSend &message);
+
+    // Body of a compacted message, encoded again from the source. The last
+    // one is kept for the other fragments and hosts of the same message.
+    Body *regenerate(ToSend &message);
+
+    std::vector<SeqWindow<>> received_;
+    std::vector<std::unordered_map<u32, Partial>> partial_;
+    std::vector<std::vector<u8>> pool_;
+
+    // Each link numbers its messages independently, from the end of its ring
+    // of unacknowledged messages, so that the receiver's window only ever sees
+    // a dense range of seqs.
+    std::vector<SeqRing<ToSend>> sent_;
+    std::vector<Peer> peers_;
+    size_t budget_;
+    u32 fragmentWindow_;
+    size_t maxPartials_;
+    std::vector<u8> scratch_;
+    std::vector<u8> inbox_;
+    std::vector<std::map<u32, Tagged>> tagged_;
+    std::vector<std::unordered_map<u64, Latest>> latest_;
 
-    u32 seq_;
+    std::vector<std::vector<u32>> pendingAcks_;
+    std::vector<Clock::time_point> ackSince_;
 
-    std::vector<DeliveredEntry> received_;
-    std::vector<std::map<u32, ToSend>> sent_;
-    Clock::time_point lastSend_;
+    Source source_;
+    Release release_;
+    std::unordered_map<u64, u32> compacted_; // compacted messages by ref
+    Body *regenerated_;
+    u64 regeneratedRef_;
 
     Callback callback_;
+    TickCallback tickCallback_;
+    DroppedCallback droppedCallback_;
 
     UdpSocket socket;
 };
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "serde.hpp"
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <vector>
+
+// Reorders messages numbered 1, 2, 3... so that they are delivered in
+// sequence. Early messages are stored in a power-of-two ring indexed by their
+// order; only those too far ahead of the next expected order spill into an
+// ordered overflow map.
+template <typename T, size_t Size = 1024> class ReorderWindow {
+    static_assert(Size > 0 && (Size & (Size - 1)) == 0,
+                  "ReorderWindow size must be a power of two");
+
+  public:
+    ReorderWindow(u32 first = 1);
+
+    template <typename F> void push(u32 order, const T &value, F &&cb);
+
+    u32 next() const { return next_; }
+
+  private:
+    const static u32 MASK = static_cast<u32>(Size - 1);
+
+    template <typename F> void drain(F &&cb);
+
+    u32 next_;
+    std::vector<std::optional<T>> slots_;
+    std::map<u32, T> overflow_;
+};
+
+#include "../src/reorder_window.tpp"
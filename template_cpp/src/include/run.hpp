@@ -0,0 +1,15 @@
+#pragma once
+
+#include <ostream>
+
+// Runs the workload described by the config file. Returns only through an
+// exception, e.g. once a replayed trace is exhausted.
+void run();
+
+// Makes the threads submitting proposals stop waiting for decisions, and
+// joins them. They use state on the stack of run(), and must be done before
+// the process exits.
+void stopSubmitters();
+
+// Writes what has been broadcast, delivered or decided so far.
+void writeOutput(std::ostream &out);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "serde.hpp"
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+// Values keyed by consecutive seqs, appended at end() and erased in any
+// order. They live in a power-of-two ring indexed by seq, which doubles when
+// the span between the oldest live value and end() no longer fits. Iteration
+// visits that span in seq order without allocating.
+template <typename T> class SeqRing {
+  public:
+    SeqRing(u32 first = 1, size_t capacity = 64);
+
+    // Stores `value` under seq end().
+    void push(const T &value);
+
+    T *find(u32 seq);
+    void erase(u32 seq);
+
+    // Calls `f` on every value with a seq of at least `from`, which may lie
+    // before begin() or at end(). The span must stay under 2^31 seqs.
+    template <typename F> void forEach(u32 from, F &&f);
+
+    u32 begin() const { return begin_; }
+    u32 end() const { return end_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+  private:
+    std::optional<T> &slot(u32 seq) {
+        return slots_[seq & (slots_.size() - 1)];
+    }
+    void grow();
+
+    u32 begin_;
+    u32 end_;
+    size_t size_;
+    std::vector<std::optional<T>> slots_;
+};
+
+#include "../src/seq_ring.tpp"
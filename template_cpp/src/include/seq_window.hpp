@@ -0,0 +1,35 @@
+#pragma once
+
+#include "serde.hpp"
+#include <cstddef>
+#include <vector>
+
+// Remembers which seqs of a link have been delivered: everything below the
+// watermark, plus a fixed-size ring of bits for the seqs just above it. Seqs
+// too far ahead of the watermark cannot be recorded and are left for the
+// sender to retransmit once the window has moved.
+template <size_t Size = 1 << 16> class SeqWindow {
+    static_assert(Size >= 64 && (Size & (Size - 1)) == 0,
+                  "SeqWindow size must be a power of two of at least 64");
+
+  public:
+    enum class Result { NEW, DUPLICATE, AHEAD };
+
+    SeqWindow(u32 first = 1);
+
+    Result mark(u32 seq);
+
+    u32 watermark() const { return watermark_; }
+
+  private:
+    const static u32 MASK = static_cast<u32>(Size - 1);
+
+    bool test(u32 seq) const {
+        return (bits_[(seq & MASK) >> 6] >> (seq & 63)) & 1;
+    }
+
+    u32 watermark_;
+    std::vector<u64> bits_;
+};
+
+#include "../src/seq_window.tpp"
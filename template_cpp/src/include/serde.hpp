@@ -7,11 +7,17 @@
 #include <netinet/in.h>
 #include <string>
 #include <variant>
+#include <vector>
 
 typedef uint8_t u8;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+// Bytes left from `buff` up to `end`, which decoders check before reading.
+static inline size_t remaining(const u8 *buff, const u8 *end) {
+    return static_cast<size_t>(end - buff);
+}
+
 static inline u8 *write_byte(u8 *buff, u8 b) {
     buff[0] = b;
     return buff + 1;
@@ -31,6 +37,18 @@ static inline u8 *read_u32(u8 *buff, u32 &u) {
     return buff + 4;
 }
 
+static inline u8 *write_u64(u8 *buff, u64 u) {
+    buff = write_u32(buff, static_cast<u32>(u >> 32));
+    return write_u32(buff, static_cast<u32>(u));
+}
+static inline u8 *read_u64(u8 *buff, u64 &u) {
+    u32 high, low;
+    buff = read_u32(buff, high);
+    buff = read_u32(buff, low);
+    u = (static_cast<u64>(high) << 32) | low;
+    return buff;
+}
+
 static inline u8 *write_str(u8 *buff, const std::string &str) {
     buff = write_u32(buff, static_cast<u32>(str.length()));
     memcpy(buff, str.c_str(), str.length());
@@ -49,6 +67,23 @@ static inline u8 *read_str(u8 *buff, std::string &str) {
 static inline u8 *ser(const std::monostate &, u8 *buff, size_t &) {
     return buff;
 }
-static inline u8 *deserialize(std::monostate &, u8 *buff, size_t &) {
+static inline u8 *deserialize(std::monostate &, u8 *buff, const u8 *,
+                              size_t &) {
     return buff;
 }
+static inline size_t serSize(const std::monostate &) { return 0; }
+static inline void supersedeKeys(const std::monostate &, std::vector<u32> &) {}
+
+static inline u8 *ser(const u32 &u, u8 *buff, size_t &s) {
+    s += sizeof(u32);
+    return write_u32(buff, u);
+}
+static inline u8 *deserialize(u32 &u, u8 *buff, const u8 *end, size_t &s) {
+    if (remaining(buff, end) < sizeof(u32)) {
+        return nullptr;
+    }
+    s += sizeof(u32);
+    return read_u32(buff, u);
+}
+static inline size_t serSize(const u32 &) { return sizeof(u32); }
+static inline void supersedeKeys(const u32 &, std::vector<u32> &) {}
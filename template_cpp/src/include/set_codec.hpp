@@ -0,0 +1,251 @@
+#pragma once
+
+#include "serde.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Wire encodings of a sorted set of u32 values: a tag byte and the value
+// count, then either
+//  - SET_RAW: the values as big-endian u32s,
+//  - SET_DELTA: the first value and the gaps between consecutive values as
+//    LEB128 varints, for sparse sets,
+//  - SET_BITMAP: the smallest value, the length in bytes of a bitmap of the
+//    values from there on, and the bitmap, for dense sets.
+// write_set() picks whichever is smallest. read_set() checks the count and
+// the bitmap length against the bytes left before trusting them.
+enum SetEncoding : u8 { SET_RAW = 0, SET_DELTA = 1, SET_BITMAP = 2 };
+
+const size_t SET_META_SIZE = 1 + sizeof(u32);
+
+static inline size_t varint_size(u32 v) {
+    size_t size = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static inline u8 *write_varint(u8 *buff, u32 v) {
+    while (v >= 0x80) {
+        *buff++ = static_cast<u8>(v | 0x80);
+        v >>= 7;
+    }
+    *buff++ = static_cast<u8>(v);
+    return buff;
+}
+
+// Returns nullptr if the varint runs past `end` or does not fit a u32.
+static inline u8 *read_varint(u8 *buff, const u8 *end, u32 &v) {
+    v = 0;
+    for (u32 shift = 0; shift < 32; shift += 7) {
+        if (buff == end) {
+            return nullptr;
+        }
+        u8 b = *buff++;
+        v |= static_cast<u32>(b & 0x7f) << shift;
+        if (b < 0x80) {
+            return buff;
+        }
+    }
+    return nullptr;
+}
+
+static inline size_t bitmap_bytes(const u32 *values, size_t count) {
+    return (values[count - 1] - values[0]) / 8 + 1;
+}
+
+static inline size_t delta_size(const u32 *values, size_t count) {
+    size_t size = varint_size(values[0]);
+    for (size_t i = 1; i < count; ++i) {
+        size += varint_size(values[i] - values[i - 1]);
+    }
+    return size;
+}
+
+static inline SetEncoding set_encoding(const u32 *values, size_t count,
+                                       size_t &size) {
+    size = sizeof(u32) * count;
+    if (count == 0) {
+        return SET_RAW;
+    }
+
+    SetEncoding encoding = SET_RAW;
+
+    size_t bitmap = 2 * sizeof(u32) + bitmap_bytes(values, count);
+    if (bitmap < size) {
+        encoding = SET_BITMAP;
+        size = bitmap;
+    }
+
+    // Every varint takes at least a byte, so only a sparse enough set is
+    // worth a pass to size its deltas.
+    if (bitmap > count) {
+        size_t delta = delta_size(values, count);
+        if (delta < size) {
+            encoding = SET_DELTA;
+            size = delta;
+        }
+    }
+
+    return encoding;
+}
+
+static inline size_t set_size(const std::vector<u32> &values) {
+    size_t size;
+    set_encoding(values.data(), values.size(), size);
+    return SET_META_SIZE + size;
+}
+
+// Byte-swaps whole blocks at a time; the loop is simple enough for the
+// compiler to vectorize.
+static inline void copy_u32_be(u32 *dst, const u32 *src, size_t count) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = __builtin_bswap32(src[i]);
+    }
+#else
+    memcpy(dst, src, count * sizeof(u32));
+#endif
+}
+
+static inline u8 *write_set(u8 *buff, const std::vector<u32> &values) {
+    const u32 *v = values.data();
+    size_t count = values.size();
+
+    size_t size;
+    SetEncoding encoding = set_encoding(v, count, size);
+
+    buff = write_byte(buff, encoding);
+    buff = write_u32(buff, static_cast<u32>(count));
+
+    switch (encoding) {
+        case SET_RAW: {
+            u32 block[256];
+            for (size_t i = 0; i < count; i += 256) {
+                size_t n = std::min<size_t>(256, count - i);
+                copy_u32_be(block, v + i, n);
+                memcpy(buff, block, n * sizeof(u32));
+                buff += n * sizeof(u32);
+            }
+            return buff;
+        }
+        case SET_DELTA: {
+            buff = write_varint(buff, v[0]);
+            for (size_t i = 1; i < count; ++i) {
+                buff = write_varint(buff, v[i] - v[i - 1]);
+            }
+            return buff;
+        }
+        case SET_BITMAP:
+        default: {
+            size_t bytes = bitmap_bytes(v, count);
+            buff = write_u32(buff, v[0]);
+            buff = write_u32(buff, static_cast<u32>(bytes));
+
+            memset(buff, 0, bytes);
+            for (size_t i = 0; i < count; ++i) {
+                u32 bit = v[i] - v[0];
+                buff[bit >> 3] |= static_cast<u8>(1 << (bit & 7));
+            }
+            return buff + bytes;
+        }
+    }
+}
+
+static inline u8 *read_set(u8 *buff, const u8 *end, std::vector<u32> &values,
+                           size_t &s) {
+    if (remaining(buff, end) < SET_META_SIZE) {
+        return nullptr;
+    }
+
+    u8 encoding;
+    u32 count;
+    buff = read_byte(buff, encoding);
+    buff = read_u32(buff, count);
+
+    u8 *start = buff;
+    size_t left = remaining(buff, end);
+
+    if (count == 0) {
+        values.clear();
+        s += SET_META_SIZE;
+        return buff;
+    }
+
+    switch (encoding) {
+        case SET_DELTA: {
+            // Every varint takes at least a byte.
+            if (count > left) {
+                return nullptr;
+            }
+            values.resize(count);
+            u32 *v = values.data();
+
+            buff = read_varint(buff, end, v[0]);
+            for (size_t i = 1; i < count && buff != nullptr; ++i) {
+                u32 gap;
+                buff = read_varint(buff, end, gap);
+                v[i] = v[i - 1] + gap;
+            }
+            if (buff == nullptr) {
+                return nullptr;
+            }
+            break;
+        }
+        case SET_BITMAP: {
+            if (left < 2 * sizeof(u32)) {
+                return nullptr;
+            }
+            u32 base, bytes;
+            buff = read_u32(buff, base);
+            buff = read_u32(buff, bytes);
+
+            if (bytes > left - 2 * sizeof(u32) ||
+                count > static_cast<u64>(bytes) * 8) {
+                return nullptr;
+            }
+            values.resize(count);
+            u32 *v = values.data();
+
+            // Scan eight bytes at a time, and only look at the set bits.
+            size_t i = 0;
+            for (u32 offset = 0; offset < bytes; offset += 8) {
+                u64 word = 0;
+                memcpy(&word, buff + offset, std::min<u32>(8, bytes - offset));
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+                word = __builtin_bswap64(word);
+#endif
+                while (word != 0 && i < count) {
+                    u32 bit = static_cast<u32>(__builtin_ctzll(word));
+                    v[i++] = base + offset * 8 + bit;
+                    word &= word - 1;
+                }
+            }
+            if (i < count) {
+                return nullptr;
+            }
+
+            buff += bytes;
+            break;
+        }
+        case SET_RAW:
+        default: {
+            if (count > left / sizeof(u32)) {
+                return nullptr;
+            }
+            values.resize(count);
+            u32 *v = values.data();
+
+            memcpy(v, buff, count * sizeof(u32));
+            copy_u32_be(v, v, count);
+            buff += count * sizeof(u32);
+            break;
+        }
+    }
+
+    s += SET_META_SIZE + static_cast<size_t>(buff - start);
+    return buff;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "serde.hpp"
+#include <cstdint>
+#include <ostream>
+#include <variant>
+
+// Layers of the stack that the bytes on the wire are charged to. FIFO
+// broadcast adds nothing of its own: it orders messages by their URB number.
+enum class Layer : uint8_t { LINK, URB, FIFO, LATTICE, APP, COUNT };
+
+static inline u64 &layerBytes(u64 *bytes, Layer layer) {
+    return bytes[static_cast<size_t>(layer)];
+}
+
+// Charges the `size` bytes of an encoded payload to the layers that wrote
+// them. The pointer only selects the payload type: each layer overloads this
+// for the payloads it encodes, and anything else belongs to the application.
+static inline void chargeWire(const u32 *, size_t size, u64 *bytes) {
+    layerBytes(bytes, Layer::APP) += size;
+}
+static inline void chargeWire(const std::monostate *, size_t size,
+                              u64 *bytes) {
+    layerBytes(bytes, Layer::APP) += size;
+}
+
+// Log-linear histogram of durations in nanoseconds, with 8 buckets per power
+// of two: percentiles are accurate to within 12.5%.
+struct Histogram {
+    u64 buckets[64 * 8] = {};
+    u64 count = 0;
+    u64 max = 0;
+
+    void record(u64 ns);
+    u64 percentile(double p) const;
+};
+
+// Process-wide counters, used to tell which layer of the stack limits
+// throughput.
+struct Stats {
+    u64 datagramsSent = 0;
+    u64 bytesSent = 0;
+    u64 datagramsReceived = 0;
+    u64 bytesReceived = 0;
+    u64 sendErrors = 0;
+    u64 evicted = 0;
+
+    u64 layerBytesSent[static_cast<size_t>(Layer::COUNT)] = {};
+    u64 layerBytesReceived[static_cast<size_t>(Layer::COUNT)] = {};
+
+    u64 linkDelivered = 0;
+    u64 urbDelivered = 0;
+    u64 fifoDelivered = 0;
+    u64 decided = 0;
+
+    // From the kernel receiving a datagram to the event loop reading it.
+    Histogram receiveLatency;
+
+    void report(std::ostream &os, double seconds) const;
+};
+
+extern Stats stats;
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "clock.hpp"
+#include "host.hpp"
+#include "serde.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Binary trace of the datagrams received by a process. The file starts with
+// TRACE_MAGIC, followed by one record per datagram: a TRACE_HEADER_SIZE
+// header (receive time in nanoseconds, sender ip, sender port and datagram
+// length) and the datagram itself. A record cut short by the process being
+// killed ends the trace.
+const size_t TRACE_HEADER_SIZE = 16;
+const char TRACE_MAGIC[8] = {'D', 'A', 'T', 'R', 'A', 'C', 'E', '1'};
+
+class TraceWriter {
+  public:
+    TraceWriter(const std::string &path);
+    ~TraceWriter();
+
+    void record(Clock::time_point t, const Host &from, const void *data,
+                size_t size);
+
+  private:
+    // A stdio stream, so that exit() from the signal handler flushes it.
+    FILE *file_;
+    std::vector<char> buffer_;
+};
+
+class TraceReader {
+  public:
+    TraceReader(const std::string &path);
+    ~TraceReader();
+
+    // Receive time of the first datagram.
+    Clock::time_point start() const { return start_; }
+
+    // Reads the next datagram into `buffer`. Returns false at the end of the
+    // trace.
+    bool next(Clock::time_point &t, Host &from, void *buffer, size_t &size);
+
+  private:
+    FILE *file_;
+    Clock::time_point start_;
+};
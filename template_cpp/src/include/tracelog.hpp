@@ -0,0 +1,89 @@
+#pragma once
+
+#include "serde.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class TraceEvent : uint16_t {
+    PROPOSE,
+    PROPOSAL_RECEIVED,
+    ACK_SENT,
+    NACK_SENT,
+    ACK_RECEIVED,
+    NACK_RECEIVED,
+    DECIDE,
+    RETRANSMIT,
+    DECISION_ADOPTED,
+    COUNT
+};
+
+// Fixed-size binary record of a tracepoint. The meaning of `args` depends on
+// the event, see traceEventArgs().
+struct TraceRecord {
+    u64 time;
+    uint16_t thread;
+    TraceEvent event;
+    u32 args[5];
+};
+
+const char *traceEventName(TraceEvent event);
+const char *const *traceEventArgs(TraceEvent event);
+
+const char TRACELOG_MAGIC[8] = {'D', 'A', 'L', 'O', 'G', '0', '0', '1'};
+
+// Tracepoints are compiled in everywhere, but only record anything once
+// open() has been called (with `--tracelog PATH`). Each thread appends to its
+// own single-producer ring, without locks or syscalls; a background thread
+// drains the rings to the file. Records are dropped, and counted, when a ring
+// is full.
+class TraceLog {
+  public:
+    ~TraceLog();
+
+    void open(const std::string &path);
+    void close();
+
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    void record(TraceEvent event, u32 a0, u32 a1, u32 a2, u32 a3, u32 a4);
+
+  private:
+    const static size_t RING_SIZE = 1 << 16;
+
+    struct Ring {
+        std::atomic<size_t> head{0};
+        std::atomic<size_t> tail{0};
+        std::atomic<u64> dropped{0};
+        uint16_t thread = 0;
+        std::vector<TraceRecord> records = std::vector<TraceRecord>(RING_SIZE);
+    };
+
+    Ring &ring();
+    void drain();
+    void run();
+
+    std::atomic<bool> enabled_{false};
+    std::atomic<bool> stopping_{false};
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Ring>> rings_;
+    FILE *file_ = nullptr;
+    std::thread drainer_;
+};
+
+extern TraceLog tracelog;
+
+static inline void trace(TraceEvent event, u32 a0 = 0, u32 a1 = 0, u32 a2 = 0,
+                         u32 a3 = 0, u32 a4 = 0) {
+    if (tracelog.enabled()) {
+        tracelog.record(event, a0, a1, a2, a3, a4);
+    }
+}
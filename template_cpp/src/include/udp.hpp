@@ -1,21 +1,54 @@
+#pragma once
+
 #include <cstddef>
 #include <exception>
+#include <memory>
 #include <parser.hpp>
 
 #define UDP_PACKET_MAX_SIZE 65507
 
 class UdpException : public std::exception {
   public:
-    enum class Type { OPT, BIND, INVALID_IP, SEND, RECEIVE };
+    enum class Type {
+        OPT,
+        BIND,
+        INVALID_IP,
+        SEND,
+        RECEIVE,
+        URING,
+        TRACE,
+        TRACE_END
+    };
 
     UdpException(Type t);
 
     virtual const char *what() const noexcept;
+    Type type() const { return t; }
 
   private:
     Type t;
 };
 
+class UringSocket;
+class TraceWriter;
+class TraceReader;
+
+// Uses io_uring when started with `--udp-backend io_uring` (add `--sqpoll` for
+// kernel-side submission polling), and plain sockets otherwise or when
+// io_uring is unavailable.
+//
+// By default, a loop iteration that neither sent nor received anything ends
+// with idle() blocking until a datagram arrives, for at most IDLE_TIMEOUT_MS
+// so that timers still fire. `--busy-poll [CPU]` trades CPU for latency: the
+// loop never blocks, the socket busy-polls the device queue and gets large
+// buffers, and run() pins the loop thread to CPU, if given. Either way, the
+// socket backend timestamps incoming datagrams to report how long they waited
+// for the loop.
+//
+// `--record-trace PATH` saves every received datagram to a trace file.
+// `--replay-trace PATH` opens no socket at all: datagrams are read back from
+// the trace, sends are dropped, and receiving past the end of the trace throws
+// TRACE_END.
 class UdpSocket {
   public:
     UdpSocket(const Host &host);
@@ -23,7 +56,25 @@ class UdpSocket {
 
     size_t sendTo(const void *data, size_t size, const Host &host);
     size_t recvFrom(void *buffer, size_t size, Host &host);
+    void idle();
+
+    // Bytes the kernel lets queue in either buffer of the socket, its own
+    // bookkeeping included. When replaying, those of a socket set up the
+    // same way.
+    size_t bufferSize() const;
 
   private:
+    const static int IDLE_TIMEOUT_MS = 1;
+    const static int BUSY_POLL_US = 50;
+    const static int BUSY_POLL_BUFFER_SIZE = 8 * 1024 * 1024;
+
     int fd;
+    bool busyPoll_;
+    bool active_;
+    std::unique_ptr<UringSocket> uring_;
+    std::unique_ptr<TraceWriter> record_;
+    std::unique_ptr<TraceReader> replay_;
+
+    void sizeBuffers(int socketFd) const;
+    void record(const void *buffer, size_t size, const Host &host);
 };
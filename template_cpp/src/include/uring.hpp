@@ -0,0 +1,86 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <deque>
+#include <host.hpp>
+#include <serde.hpp>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// UDP transport over io_uring. Receives are posted ahead of time into a fixed
+// pool of buffers, and sends are queued in the submission ring and handed to
+// the kernel in batches (or picked up by the kernel thread with SQ polling).
+// Throws UdpException::Type::URING if io_uring cannot be used.
+class UringSocket {
+  public:
+    UringSocket(int fd, bool sqpoll);
+    ~UringSocket();
+
+    UringSocket(const UringSocket &) = delete;
+    UringSocket &operator=(const UringSocket &) = delete;
+
+    size_t sendTo(const void *data, size_t size, const Host &host);
+    size_t recvFrom(void *buffer, size_t size, Host &host);
+
+    void submit();
+
+    // Blocks until the ring holds a completion, for at most `timeoutMs`.
+    void wait(int timeoutMs);
+
+  private:
+    const static unsigned ENTRIES = 256;
+    const static size_t RECV_SLOTS = 32;
+    const static size_t SEND_SLOTS = 128;
+    const static unsigned SEND_BATCH = 32;
+    const static u64 SEND_TAG = 1ull << 32;
+
+    struct Slot {
+        std::vector<u8> buffer;
+        struct iovec iov;
+        struct msghdr msg;
+        struct sockaddr_in addr;
+        size_t length;
+    };
+
+    void release();
+    void setupSlot(Slot &slot);
+    io_uring_sqe *nextSqe();
+    void postRecv(size_t idx);
+    void reap();
+    void waitCompletion();
+
+    int fd_;
+    int ringFd_;
+    bool sqpoll_;
+
+    void *sqRing_;
+    size_t sqRingSize_;
+    void *cqRing_;
+    size_t cqRingSize_;
+    io_uring_sqe *sqes_;
+    size_t sqesSize_;
+    bool extArg_;
+
+    unsigned *sqHead_;
+    unsigned *sqTail_;
+    unsigned *sqMask_;
+    unsigned *sqFlags_;
+    unsigned *sqArray_;
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned *cqMask_;
+    io_uring_cqe *cqes_;
+
+    unsigned toSubmit_;
+
+    std::vector<Slot> recvSlots_;
+    std::vector<Slot> sendSlots_;
+    std::vector<size_t> freeSends_;
+    std::deque<size_t> ready_;
+};
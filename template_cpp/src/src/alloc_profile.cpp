@@ -0,0 +1,108 @@
+#include <alloc_profile.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+static const char *const NAMES[] = {"other", "link", "urb",
+                                    "fifo",  "lattice", "app"};
+
+static_assert(sizeof(NAMES) / sizeof(NAMES[0]) ==
+                  static_cast<size_t>(AllocTag::COUNT),
+              "every allocation tag needs a name");
+
+const char *allocTagName(AllocTag tag) {
+    if (tag >= AllocTag::COUNT) {
+        return "unknown";
+    }
+    return NAMES[static_cast<size_t>(tag)];
+}
+
+#ifdef ALLOC_PROFILE
+
+struct Counters {
+    std::atomic<u64> allocations{0};
+    std::atomic<u64> bytes{0};
+    std::atomic<u64> live{0};
+    std::atomic<u64> peak{0};
+};
+
+static Counters counters[static_cast<size_t>(AllocTag::COUNT)];
+static thread_local AllocTag current = AllocTag::OTHER;
+
+// Put in front of every block, and keeps it aligned for any type.
+struct alignas(std::max_align_t) Header {
+    size_t size;
+    AllocTag tag;
+};
+
+static void *allocate(size_t size) noexcept {
+    auto *header = static_cast<Header *>(malloc(sizeof(Header) + size));
+    if (header == nullptr) {
+        return nullptr;
+    }
+    header->size = size;
+    header->tag = current;
+
+    auto &c = counters[static_cast<size_t>(current)];
+    c.allocations.fetch_add(1, std::memory_order_relaxed);
+    c.bytes.fetch_add(size, std::memory_order_relaxed);
+
+    u64 live = c.live.fetch_add(size, std::memory_order_relaxed) + size;
+    u64 peak = c.peak.load(std::memory_order_relaxed);
+    while (live > peak && !c.peak.compare_exchange_weak(
+                              peak, live, std::memory_order_relaxed)) {
+    }
+
+    return header + 1;
+}
+
+static void release(void *p) noexcept {
+    if (p == nullptr) {
+        return;
+    }
+
+    auto *header = static_cast<Header *>(p) - 1;
+    counters[static_cast<size_t>(header->tag)].live.fetch_sub(
+        header->size, std::memory_order_relaxed);
+    free(header);
+}
+
+void *operator new(size_t size) {
+    void *p = allocate(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return allocate(size);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return allocate(size);
+}
+
+void operator delete(void *p) noexcept { release(p); }
+void operator delete[](void *p) noexcept { release(p); }
+void operator delete(void *p, size_t) noexcept { release(p); }
+void operator delete[](void *p, size_t) noexcept { release(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { release(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    release(p);
+}
+
+AllocScope::AllocScope(AllocTag tag) : previous_(current) { current = tag; }
+AllocScope::~AllocScope() { current = previous_; }
+
+AllocCounters allocCounters(AllocTag tag) {
+    const auto &c = counters[static_cast<size_t>(tag)];
+    return {c.allocations.load(), c.bytes.load(), c.peak.load()};
+}
+
+#else
+
+AllocCounters allocCounters(AllocTag) { return {0, 0, 0}; }
+
+#endif
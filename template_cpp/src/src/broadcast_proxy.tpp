@@ -1,105 +1,259 @@
+#include <algorithm>
 #include <broadcast_proxy.hpp>
 #include <cstdlib>
 #include <vector>
 
+#include "alloc_profile.hpp"
 #include "parser.hpp"
 #include "serde.hpp"
+#include "stats.hpp"
 
 static inline u64 id(u32 host, u32 order) {
     return (static_cast<u64>(host) << 32) | order;
 }
 
-static inline u8 *ser(const typename BroadcastProxy<std::monostate>::Payload &p,
-                      u8 *buff, size_t &s) {
-    s += 9;
-    buff = write_byte(buff, static_cast<u8>(p.isBroadcasted));
-    buff = write_u32(buff, p.host);
-    buff = write_u32(buff, p.order);
+template <typename P>
+static inline u8 *ser(const UrbBundle<P> &b, u8 *buff, size_t &s) {
+    s += BroadcastProxy<P>::BUNDLE_META_SIZE;
+    buff = write_byte(buff, static_cast<u8>(b.isBroadcasted));
+    buff = write_u32(buff, b.host);
+    buff = write_u32(buff, b.order);
+    buff = write_u32(buff, static_cast<u32>(b.payloads.size()));
+
+    for (const auto &p : b.payloads) {
+        buff = ser(p, buff, s);
+    }
     return buff;
 }
 
-static inline u8 *deserialize(
-    typename BroadcastProxy<std::monostate>::Payload &p, u8 *buff, size_t &s) {
-    s += 9;
+// The bundle header is URB's, its payloads belong to whoever wrote them.
+template <typename P>
+static inline void chargeWire(const UrbBundle<P> *, size_t size, u64 *bytes) {
+    const size_t header = BroadcastProxy<P>::BUNDLE_META_SIZE;
+    layerBytes(bytes, Layer::URB) += header;
+    chargeWire(static_cast<const P *>(nullptr), size - header, bytes);
+}
+
+template <typename P> static inline size_t serSize(const UrbBundle<P> &b) {
+    size_t size = BroadcastProxy<P>::BUNDLE_META_SIZE;
+    for (const auto &p : b.payloads) {
+        size += serSize(p);
+    }
+    return size;
+}
+
+template <typename P>
+static inline u8 *deserialize(UrbBundle<P> &b, u8 *buff, const u8 *end,
+                              size_t &s) {
+    if (remaining(buff, end) < BroadcastProxy<P>::BUNDLE_META_SIZE) {
+        return nullptr;
+    }
+    s += BroadcastProxy<P>::BUNDLE_META_SIZE;
 
     u8 isBroadcasted;
     buff = read_byte(buff, isBroadcasted);
-    p.isBroadcasted = static_cast<bool>(isBroadcasted);
+    b.isBroadcasted = static_cast<bool>(isBroadcasted);
+
+    buff = read_u32(buff, b.host);
+    buff = read_u32(buff, b.order);
 
-    buff = read_u32(buff, p.host);
-    buff = read_u32(buff, p.order);
+    u32 count;
+    buff = read_u32(buff, count);
+
+    b.payloads.resize(count);
+    for (auto &p : b.payloads) {
+        buff = deserialize(p, buff, end, s);
+        if (buff == nullptr) {
+            return nullptr;
+        }
+    }
     return buff;
 }
 
 template <typename P>
-BroadcastProxy<P>::BroadcastProxy(const Host &host) : proxy_(host), order_(1) {
-    proxy_.setCallback([&](const Message &msg, const Host &host) {
-        auto msg_id = id(msg.content.host, msg.content.order);
+BroadcastProxy<P>::BroadcastProxy(const Host &host, size_t peerBudget)
+    : proxy_(host, peerBudget), order_(1), outgoingBytes_(0),
+      bundleSize_(DEFAULT_BUNDLE_SIZE), flushLatency_(0) {
+    proxy_.setCallback([&](const typename _Proxy::Message &msg,
+                           const Host &host) {
+        AllocScope scope(AllocTag::URB);
+        const auto &bundle = msg.content;
 
-        if (!msg.content.isBroadcasted) {
-            p2pCallback_(msg, host);
+        if (!bundle.isBroadcasted) {
+            for (u32 i = 0; i < bundle.payloads.size(); ++i) {
+                p2pCallback_(Message{{false, bundle.order + i, bundle.host,
+                                      bundle.payloads[i]}},
+                             host);
+            }
             return;
         }
 
-        if (delivered_.count(msg_id) == 0) {
-            if (ack_.count(msg_id) == 0) {
-                ack_.insert(
-                    {msg_id, std::vector<bool>(config.hosts().size(), false)});
-            }
-            ack_[msg_id][host.id - 1] = true;
+        auto msg_id = id(bundle.host, bundle.order);
+
+        if (delivered_.count(msg_id) != 0) {
+            return;
+        }
 
-            if (pending_.count(msg_id) == 0) {
-                pending_.insert({msg_id, msg.content});
-                for (auto &send_to : config.hosts()) {
-                    proxy_.send(msg.content, send_to);
-                }
+        if (ack_.count(msg_id) == 0) {
+            ack_.insert(
+                {msg_id, std::vector<bool>(config.hosts().size(), false)});
+        }
+        ack_[msg_id][host.id - 1] = true;
+
+        if (pending_.count(msg_id) == 0) {
+            pending_.insert({msg_id, bundle});
+            proxy_.send(bundle, config.hosts(), tags(bundle), msg_id);
+
+            // A newer bundle from the same origin was relayed first.
+            if (delivered_.count(msg_id) != 0) {
+                return;
             }
+        }
 
-            size_t acked_count = 0;
-            for (auto b : ack_[msg_id]) {
-                if (b) {
-                    acked_count++;
-                }
+        size_t acked_count = 0;
+        for (auto b : ack_[msg_id]) {
+            if (b) {
+                acked_count++;
             }
+        }
+
+        if (static_cast<float>(acked_count) >
+            static_cast<float>(config.hosts().size()) / 2.0f) {
+            deliver(bundle);
+            forget(msg_id);
+        }
+    });
 
-            if (static_cast<float>(acked_count) >
-                static_cast<float>(config.hosts().size()) / 2.0f) {
-                broadcastCallback_(msg);
-                ack_.erase(msg_id);
+    // Some host will not relay a superseded or evicted bundle, so it may
+    // never gather a majority: it is given up on.
+    proxy_.setDroppedCallback([&](u64 msg_id) { forget(msg_id); });
+
+    // Links past their budget encode pending bundles again rather than keep
+    // a copy of their own, so those outlive their delivery until released.
+    proxy_.setSource(
+        [&](u64 msg_id) -> const Bundle * {
+            auto it = pending_.find(msg_id);
+            return it == pending_.end() ? nullptr : &it->second;
+        },
+        [&](u64 msg_id) {
+            if (delivered_.count(msg_id) != 0) {
                 pending_.erase(msg_id);
-                delivered_.insert(msg_id);
             }
+        });
+
+    // Payloads enqueued by the tick callback go out in the same iteration,
+    // before the loop may go idle.
+    proxy_.setTickCallback([&]() {
+        if (tickCallback_) {
+            tickCallback_();
+        }
+
+        AllocScope scope(AllocTag::URB);
+        if (!outgoing_.empty() &&
+            Clock::now() - outgoingSince_ >= flushLatency_) {
+            flush();
         }
     });
 }
 
+template <typename P>
+void BroadcastProxy<P>::setBundling(size_t maxSize, Clock::duration latency) {
+    bundleSize_ = maxSize > 0 ? maxSize : 1;
+    flushLatency_ = latency;
+}
+
 template <typename P>
 void BroadcastProxy<P>::broadcast(const std::vector<P> &payloads) {
-    std::vector<Payload> p = std::vector<Payload>(payloads.size());
+    AllocScope scope(AllocTag::URB);
+    for (const auto &p : payloads) {
+        enqueue(p);
+    }
+    flush();
+}
+template <typename P>
+void BroadcastProxy<P>::broadcast(const P &payload) {
+    AllocScope scope(AllocTag::URB);
+    enqueue(payload);
+}
+
+template <typename P> void BroadcastProxy<P>::enqueue(const P &payload) {
+    const size_t maxBytes = UDP_PACKET_MAX_SIZE - _Proxy::MSG_META_SIZE -
+                            BUNDLE_META_SIZE;
+    size_t size = serSize(payload);
+
+    if (!outgoing_.empty() && outgoingBytes_ + size > maxBytes) {
+        flush();
+    }
+
+    if (outgoing_.empty()) {
+        outgoingSince_ = Clock::now();
+    }
+    outgoing_.push_back(payload);
+    outgoingBytes_ += size;
+
+    if (outgoing_.size() >= bundleSize_) {
+        flush();
+    }
+}
 
-    for (size_t i = 0; i < payloads.size(); i++) {
-        p[i] = {true, order_++, static_cast<u32>(config.id()), payloads[i]};
-        auto msg_id = id(p[i].host, p[i].order);
-        pending_.insert({msg_id, p[i]});
+template <typename P> void BroadcastProxy<P>::flush() {
+    if (outgoing_.empty()) {
+        return;
     }
 
-    for (auto &host : config.hosts()) {
-        proxy_.send(p, host);
+    AllocScope scope(AllocTag::URB);
+
+    Bundle b = {true, order_, static_cast<u32>(config.id()), {}};
+    b.payloads.swap(outgoing_);
+    order_ += static_cast<u32>(b.payloads.size());
+    outgoingBytes_ = 0;
+
+    auto msg_id = id(b.host, b.order);
+    auto &bundle = pending_.insert({msg_id, std::move(b)}).first->second;
+
+    proxy_.send(bundle, config.hosts(), tags(bundle), msg_id);
+}
+
+template <typename P> void BroadcastProxy<P>::forget(u64 msg_id) {
+    ack_.erase(msg_id);
+    if (!proxy_.compacted(msg_id)) {
+        pending_.erase(msg_id);
     }
+    delivered_.insert(msg_id);
 }
+
 template <typename P>
-void BroadcastProxy<P>::broadcast(const P &payload) {
-    Payload p = {true, order_++, static_cast<u32>(config.id()), payload};
-    auto msg_id = id(p.host, p.order);
-    pending_.insert({msg_id, p});
+void BroadcastProxy<P>::deliver(const Bundle &bundle) {
+    Message msg = {{true, bundle.order, bundle.host, {}}};
+
+    for (const auto &p : bundle.payloads) {
+        msg.content.payload = p;
+        stats.urbDelivered++;
+        broadcastCallback_(msg);
+        msg.content.order++;
+    }
+}
+
+template <typename P>
+std::vector<typename BroadcastProxy<P>::_Proxy::Tag>
+BroadcastProxy<P>::tags(const Bundle &bundle) {
+    std::vector<u32> keys;
+    for (const auto &p : bundle.payloads) {
+        supersedeKeys(p, keys);
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
 
-    for (auto &host : config.hosts()) {
-        proxy_.send(p, host);
+    std::vector<typename _Proxy::Tag> t(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        t[i] = {id(bundle.host, keys[i]), bundle.order};
     }
+    return t;
 }
 
 template <typename P>
 void BroadcastProxy<P>::send(const P &payload, const Host &host) {
-    Payload p = {false, order_++, static_cast<u32>(config.id()), payload};
-    proxy_.send(p, host);
+    AllocScope scope(AllocTag::URB);
+    Bundle b = {false, order_++, static_cast<u32>(config.id()), {payload}};
+    proxy_.send(b, host);
 }
@@ -0,0 +1,18 @@
+#include <clock.hpp>
+
+bool Clock::pinned_ = false;
+Clock::time_point Clock::time_;
+
+Clock::time_point Clock::now() {
+    if (pinned_) {
+        return time_;
+    }
+
+    return time_point(std::chrono::duration_cast<duration>(
+        std::chrono::steady_clock::now().time_since_epoch()));
+}
+
+void Clock::pin(time_point t) {
+    pinned_ = true;
+    time_ = t;
+}
@@ -1,35 +1,28 @@
+#include <alloc_profile.hpp>
 #include <frb.hpp>
+#include <stats.hpp>
 #include <vector>
 
 template <typename Payload>
-FifoProxy<Payload>::FifoProxy(const Host &host)
-    : proxy_(host), received_(config.hosts().size()),
-      delivered_(config.hosts().size(), 1) {
-    proxy_.setCallback([&](const Message &msg) {
-        auto host_id = msg.content.host - 1;
-        auto &to_deliver = delivered_[host_id];
-        auto &received = received_[host_id];
-
-        if (to_deliver == msg.content.order) {
-            callback_(msg);
-            to_deliver++;
-
-            while (!received.empty() && received.begin()->first == to_deliver) {
-                callback_(received.begin()->second);
-                received.erase(received.begin());
-                to_deliver++;
-            }
-        } else {
-            received.insert({msg.content.order, msg});
-        }
+FifoProxy<Payload>::FifoProxy(const Host &host, size_t peerBudget)
+    : proxy_(host, peerBudget), received_(config.hosts().size()) {
+    proxy_.setBroadcastCallback([&](const Message &msg) {
+        AllocScope scope(AllocTag::FIFO);
+        received_[msg.content.host - 1].push(
+            msg.content.order, msg, [&](const Message &m) {
+                stats.fifoDelivered++;
+                callback_(m);
+            });
     });
 }
 
 template <typename Payload>
 void FifoProxy<Payload>::broadcast(const std::vector<Payload> &payloads) {
+    AllocScope scope(AllocTag::FIFO);
     proxy_.broadcast(payloads);
 }
 template <typename Payload>
 void FifoProxy<Payload>::broadcast(const Payload &payload) {
+    AllocScope scope(AllocTag::FIFO);
     proxy_.broadcast(payload);
 }
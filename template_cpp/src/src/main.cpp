@@ -1,18 +1,18 @@
 #include <signal.h>
 
+#include <chrono>
 #include <cmath>
 #include <exception>
 #include <fstream>
 #include <ios>
 #include <iostream>
-#include <vector>
 
-#include "agreement.hpp"
 #include "parser.hpp"
-#include "serde.hpp"
+#include "run.hpp"
+#include "stats.hpp"
+#include "tracelog.hpp"
 
-static u32 done = 0;
-static std::vector<std::set<u32>> results;
+static std::chrono::steady_clock::time_point start;
 
 static void stop(int) {
     // reset signal handlers to default
@@ -22,21 +22,27 @@ static void stop(int) {
     // immediately stop network packet processing
     std::cout << "Immediately stopping network packet processing.\n";
 
+    // exit() would abort on submitter threads still running.
+    stopSubmitters();
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    stats.report(std::cout, elapsed.count());
+
     // write/flush output file if necessary
     std::cout << "Writing output.\n";
 
     std::fstream out(config.outputPath(),
                      std::ios_base::out | std::ios_base::trunc);
 
-    for (const auto &result : results) {
-        for (auto elem : result) {
-            out << elem << " ";
-        }
-        out << "\n";
-    }
+    writeOutput(out);
     out.flush();
     out.close();
 
+    // Not left to the destructor, which would join the drainer thread after
+    // exit() has started tearing the process down.
+    tracelog.close();
+
     // exit directly from signal handler
     exit(0);
 }
@@ -46,7 +52,6 @@ int main(int argc, char **argv) {
     signal(SIGINT, stop);
 
     config.parse(argc, argv);
-    results.resize(config.proposals().size());
 
     std::cout << std::endl;
 
@@ -78,23 +83,10 @@ int main(int argc, char **argv) {
     std::cout << "Broadcasting and delivering messages...\n\n";
     std::cout.flush();
 
-    Agreement agreement(config.host(), config.proposals().size());
-
-    agreement.setCallback([&](u32 lattice_idx, const std::set<u32> &proposal) {
-        results[lattice_idx] = proposal;
-
-        done++;
-        if (done == results.size()) {
-            std::cout << "Done !" << std::endl;
-        }
-    });
+    start = std::chrono::steady_clock::now();
 
     try {
-        for (size_t i = 0; i < config.proposals().size(); ++i) {
-            agreement.propose(config.proposals()[i], static_cast<u32>(i));
-        }
-
-        agreement.wait();
+        run();
     } catch (const std::exception &e) {
         std::cerr << e.what() << std::endl;
         exit(-1);
@@ -0,0 +1,37 @@
+#include <mpsc_queue.hpp>
+#include <utility>
+
+template <typename T> MpscQueue<T>::MpscQueue() : tail_(new Node()) {
+    head_.store(tail_);
+}
+
+template <typename T> MpscQueue<T>::~MpscQueue() {
+    while (tail_ != nullptr) {
+        Node *next = tail_->next.load();
+        delete tail_;
+        tail_ = next;
+    }
+}
+
+template <typename T> void MpscQueue<T>::push(T value) {
+    Node *node = new Node();
+    node->value = std::move(value);
+
+    Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+}
+
+template <typename T>
+template <typename F>
+void MpscQueue<T>::drain(F &&f) {
+    // tail_ is a consumed node whose successor holds the oldest value.
+    Node *next = tail_->next.load(std::memory_order_acquire);
+
+    while (next != nullptr) {
+        f(next->value);
+
+        delete tail_;
+        tail_ = next;
+        next = tail_->next.load(std::memory_order_acquire);
+    }
+}
@@ -7,6 +7,14 @@
 
 Parser config = Parser();
 
+// Every option read by the stack, so that a misspelt one is not silently
+// ignored.
+static const char *const OPTIONS[] = {
+    "announce-decisions", "bundle-latency", "bundle-size", "busy-poll",
+    "peer-budget",        "record-trace",   "replay-trace", "sqpoll",
+    "submitters",         "tracelog",       "udp-backend",
+};
+
 bool Parser::parseInternal() {
     if (!parseID()) {
         return false;
@@ -24,6 +32,10 @@ bool Parser::parseInternal() {
         return false;
     }
 
+    if (!parseOptions()) {
+        return false;
+    }
+
     parseHosts();
 
     parseConfig();
@@ -99,13 +111,37 @@ void Parser::parseConfig() {
     std::string line;
     std::getline(input, line);
 
-    size_t first_delim = line.find_first_of(' ');
-    size_t second_delim = line.find(' ', first_delim + 1);
+    // The number of fields on the first line tells the configs apart:
+    // `m` for FIFO broadcast, `m i` for perfect links and `p vs ds` for
+    // lattice agreement.
+    std::istringstream header(line);
+    std::vector<unsigned long> fields;
+    unsigned long field;
+    while (header >> field) {
+        fields.push_back(field);
+    }
 
-    size_t p = static_cast<size_t>(std::stoi(line.substr(0, first_delim)));
-    size_t vs = static_cast<size_t>(
-        std::stoi(line.substr(first_delim + 1, second_delim - first_delim)));
-    size_t ds = static_cast<size_t>(std::stoi(line.substr(second_delim + 1)));
+    switch (fields.size()) {
+        case 1:
+            mode_ = Mode::FIFO_BROADCAST;
+            messages_ = static_cast<u32>(fields[0]);
+            return;
+        case 2:
+            mode_ = Mode::PERFECT_LINKS;
+            messages_ = static_cast<u32>(fields[0]);
+            receiverId_ = fields[1];
+            return;
+        case 3:
+            mode_ = Mode::LATTICE_AGREEMENT;
+            break;
+        default: {
+            std::ostringstream os;
+            os << "`" << configPath() << "` has an unknown format";
+            throw std::invalid_argument(os.str());
+        }
+    }
+
+    size_t p = fields[0];
 
     for (size_t i = 0; i < p; ++i) {
         std::getline(input, line);
@@ -128,7 +164,7 @@ void Parser::help(const int, char const *const *argv) {
     std::cerr << "Usage: " << argv[0]
               << " --id ID --hosts HOSTS --output OUTPUT";
 
-    std::cerr << " CONFIG\n";
+    std::cerr << " CONFIG [--OPTION [VALUE]]...\n";
 
     exit(EXIT_FAILURE);
 }
@@ -190,6 +226,30 @@ bool Parser::parseConfigPath() {
     return true;
 }
 
+bool Parser::parseOptions() {
+    for (int i = 8; i < argc_; ++i) {
+        if (std::strncmp(argv_[i], "--", 2) != 0) {
+            return false;
+        }
+
+        std::string name(argv_[i] + 2);
+        if (std::find(std::begin(OPTIONS), std::end(OPTIONS), name) ==
+            std::end(OPTIONS)) {
+            std::cerr << "Unknown option --" << name << "\n";
+            return false;
+        }
+
+        std::string value;
+        if (i + 1 < argc_ && std::strncmp(argv_[i + 1], "--", 2) != 0) {
+            value = argv_[++i];
+        }
+
+        options_[name] = value;
+    }
+
+    return true;
+}
+
 bool Parser::isPositiveNumber(const std::string &s) const {
     return !s.empty() && std::find_if(s.begin(), s.end(), [](unsigned char c) {
                              return !std::isdigit(c);
@@ -1,255 +1,822 @@
 #include <algorithm>
+#include <alloc_profile.hpp>
 #include <iostream>
-#include <optional>
 #include <proxy.hpp>
+#include <stats.hpp>
+#include <tracelog.hpp>
 
 template <typename Payload>
-Proxy<Payload>::Proxy(const Host &host)
-    : seq_(1),
-      received_(config.hosts().size(), DeliveredEntry{1, std::set<u32>()}),
-      sent_(config.hosts().size()), lastSend_(Clock::now()), socket(host) {
-    for (size_t i = 0; i < config.hosts().size() + 1; ++i) {
-        received_.emplace_back();
+Proxy<Payload>::Proxy(const Host &host, size_t budget)
+    : received_(config.hosts().size()), partial_(config.hosts().size()),
+      sent_(config.hosts().size()),
+      peers_(config.hosts().size(),
+             Peer{{}, {}, {}, TIMEOUT, TIMEOUT, {}, {}, 0, 0, 0, 0, 0, {},
+                  {}}),
+      budget_(budget), fragmentWindow_(1), maxPartials_(2),
+      scratch_(UDP_PACKET_MAX_SIZE), inbox_(UDP_PACKET_MAX_SIZE),
+      tagged_(config.hosts().size()), latest_(config.hosts().size()),
+      pendingAcks_(config.hosts().size()), ackSince_(config.hosts().size()),
+      regenerated_(nullptr), regeneratedRef_(0), socket(host) {
+    // The kernel charges a datagram for a little more than its length.
+    size_t fragments = socket.bufferSize() / config.hosts().size() /
+                       (FRAGMENT_SIZE + FRAGMENT_SIZE / 16);
+
+    fragmentWindow_ = static_cast<u32>(std::max<size_t>(fragments, 1));
+    maxPartials_ = 2 * fragmentWindow_;
+}
+template <typename Payload> Proxy<Payload>::~Proxy() {
+    for (auto &sent : sent_) {
+        sent.forEach(sent.begin(),
+                     [&](const ToSend &message) { unref(message.body); });
+    }
+    for (auto &peer : peers_) {
+        for (const auto &message : peer.backlog) {
+            unref(message.body);
+        }
     }
+    unref(regenerated_);
 }
-template <typename Payload> Proxy<Payload>::~Proxy() {}
 
 template <typename Payload>
 void Proxy<Payload>::send(const Payload &p, const Host &host) {
-    send(p, seq_++, host);
+    AllocScope scope(AllocTag::LINK);
+    size_t hostIdx = host.id - 1;
+    innerSend(hostIdx, store(hostIdx, encode(p)));
 }
 template <typename Payload>
-void Proxy<Payload>::send(const Payload &p, u32 seq, const Host &host) {
-    void *buffer = malloc(UDP_PACKET_MAX_SIZE);
-    size_t size = serialize(Message{seq, p}, reinterpret_cast<u8 *>(buffer));
+void Proxy<Payload>::send(const Payload &p, const std::vector<Host> &hosts,
+                          const std::vector<Tag> &tags, u64 ref) {
+    AllocScope scope(AllocTag::LINK);
+    Body *body = encode(p);
+    body->refs++;
+
+    for (const auto &host : hosts) {
+        size_t hostIdx = host.id - 1;
+        u32 seq = nextSeq(hostIdx);
+
+        Tagged tagged = {{}, 0};
+        for (const auto &tag : tags) {
+            auto it = latest_[hostIdx].find(tag.key);
+
+            if (it != latest_[hostIdx].end()) {
+                if (it->second.version > tag.version) {
+                    continue;
+                }
+                supersede(hostIdx, it->second.seq);
+            }
 
-    sent_[host.id - 1].insert({seq, {buffer, size, false}});
+            latest_[hostIdx][tag.key] = {tag.version, seq};
+            tagged.keys.push_back(tag.key);
+            tagged.live++;
+        }
 
-    socket.sendTo(buffer, size, host);
+        if (!tags.empty() && tagged.live == 0) {
+            // Already superseded by a message sent earlier.
+            innerSend(hostIdx, store(hostIdx, nullptr));
+            if (ref != 0 && droppedCallback_) {
+                droppedCallback_(ref);
+            }
+            continue;
+        }
+
+        if (tagged.live > 0) {
+            tagged_[hostIdx].insert({seq, std::move(tagged)});
+        }
+        innerSend(hostIdx, store(hostIdx, body, ref));
+    }
+
+    unref(body);
 }
 template <typename Payload>
 void Proxy<Payload>::send(const std::vector<Payload> &payloads,
                           const Host &host) {
-    std::vector<ToSend> messages(payloads.size());
-    for (size_t i = 0; i < payloads.size(); ++i) {
-        auto &to_send = messages[i];
-        Message msg = {seq_++, payloads[i]};
-
-        void *buffer = malloc(UDP_PACKET_MAX_SIZE);
-        size_t size = serialize(msg, reinterpret_cast<u8 *>(buffer));
-
-        to_send = {buffer, size, false};
+    AllocScope scope(AllocTag::LINK);
+    size_t hostIdx = host.id - 1;
+    u32 from = nextSeq(hostIdx);
 
-        sent_[host.id - 1].insert({msg.seq, to_send});
+    for (const auto &p : payloads) {
+        store(hostIdx, encode(p));
     }
 
-    innerSend(messages, host);
+    innerSend(hostIdx, from);
 }
 
 template <typename Payload> void Proxy<Payload>::wait() {
-    u8 buffer[UDP_PACKET_MAX_SIZE] = {0};
+    while (true) {
+        poll();
+        socket.idle();
+    }
+}
+
+template <typename Payload> void Proxy<Payload>::poll() {
+    if (tickCallback_) {
+        tickCallback_();
+    }
+
+    AllocScope scope(AllocTag::LINK);
+
+    checkRetransmissions();
 
     Host host;
-    std::optional<Message> msg = std::nullopt;
-    while (true) {
-        if (Clock::now() - lastSend_ > TIMEOUT) {
-            for (size_t hostIdx = 0; hostIdx < config.hosts().size();
-                 hostIdx++) {
-                if (sent_[hostIdx].size() == 0) {
-                    continue;
-                }
+    size_t size = socket.recvFrom(inbox_.data(), inbox_.size(), host);
+    size_t processedBytes = 0;
 
-                std::vector<ToSend> messages(sent_[hostIdx].size());
+    if (size > 0) {
+        host.id = static_cast<u32>(std::find_if(config.hosts().begin(),
+                                                config.hosts().end(),
+                                                [&](const Host &e) {
+                                                    return e.ip == host.ip &&
+                                                           e.port == host.port;
+                                                }) -
+                                   config.hosts().begin()) +
+                  1;
+        heard(host.id - 1);
 
-                size_t i = 0;
-                for (const auto &entry : sent_[hostIdx]) {
-                    messages[i] = entry.second;
-                    i++;
-                }
+        while (size > processedBytes) {
+            processedBytes += handleMessage(inbox_.data() + processedBytes,
+                                            size - processedBytes, host);
+        }
+        admit(host.id - 1);
 
-                innerSend(messages, config.host(hostIdx + 1));
-            }
-            lastSend_ = Clock::now();
+        if (!partial_[host.id - 1].empty()) {
+            expirePartials(host.id - 1);
         }
+    }
 
-        size_t size = socket.recvFrom(buffer, UDP_PACKET_MAX_SIZE, host);
-        size_t processedBytes = 0;
+    flushAcks();
+}
 
-        if (size > 0) {
-            u8 acks[8 * ACK_SIZE];
-            size_t acksSize = 0;
+template <typename Payload>
+typename Proxy<Payload>::Body *Proxy<Payload>::encode(const Payload &p) {
+    size_t size = serSize(p);
 
-            host.id =
-                static_cast<u32>(std::find_if(config.hosts().begin(),
-                                              config.hosts().end(),
-                                              [&](const Host &e) {
-                                                  return e.ip == host.ip &&
-                                                         e.port == host.port;
-                                              }) -
-                                 config.hosts().begin()) +
-                1;
+    Body *body = static_cast<Body *>(::operator new(sizeof(Body) + size));
+    body->refs = 0;
+    body->length = 0;
+    ser(p, body->data(), body->length);
 
-            while (size > processedBytes) {
-                processedBytes += handleMessage(buffer + processedBytes, host,
-                                                acks + acksSize, acksSize);
-            }
+    return body;
+}
+
+template <typename Payload> void Proxy<Payload>::unref(Body *body) {
+    if (body != nullptr && --body->refs == 0) {
+        ::operator delete(body);
+    }
+}
+
+template <typename Payload>
+u32 Proxy<Payload>::store(size_t hostIdx, Body *body, u64 ref) {
+    auto &sent = sent_[hostIdx];
+    auto &peer = peers_[hostIdx];
+    u32 first = nextSeq(hostIdx);
+
+    size_t offset = 0;
+    do {
+        u32 length = body != nullptr ? static_cast<u32>(body->length) : 0;
+        ToSend entry = {nextSeq(hostIdx), body, length,
+                        static_cast<u32>(offset), 0, false, false, false,
+                        ref, {}};
+
+        if (body != nullptr) {
+            body->refs++;
+        }
 
-            socket.sendTo(acks, acksSize, host);
+        if (peer.backlog.empty() && sent.end() - sent.begin() < MAX_SPAN &&
+            peer.bytes <= budget_) {
+            peer.bytes += held(entry);
+            push(hostIdx, entry);
+        } else {
+            peer.backlogBytes += held(entry);
+            peer.backlog.push_back(entry);
         }
+
+        offset += FRAGMENT_SIZE;
+    } while (body != nullptr && offset < body->length);
+
+    if (overBudget(hostIdx)) {
+        compact(hostIdx);
     }
+
+    return first;
 }
+template <typename Payload>
+void Proxy<Payload>::push(size_t hostIdx, const ToSend &entry) {
+    auto &sent = sent_[hostIdx];
+    auto &peer = peers_[hostIdx];
 
-template <typename Payload> void Proxy<Payload>::poll() {
-    u8 buffer[UDP_PACKET_MAX_SIZE] = {0};
+    if (sent.empty()) {
+        peer.nextRetransmit = Clock::now() + peer.backoff;
+    }
 
-    Host host;
-    std::optional<Message> msg = std::nullopt;
-    if (Clock::now() - lastSend_ > TIMEOUT) {
-        for (size_t hostIdx = 0; hostIdx < config.hosts().size(); hostIdx++) {
-            if (sent_[hostIdx].size() == 0) {
-                continue;
+    sent.push(entry);
+    if (fragmented(entry)) {
+        if (peer.fragmentsInFlight < fragmentWindow_) {
+            peer.fragmentsInFlight++;
+        } else {
+            sent.find(entry.seq)->queued = true;
+            peer.queued.push_back(entry.seq);
+        }
+    }
+}
+template <typename Payload>
+typename Proxy<Payload>::ToSend *Proxy<Payload>::findSent(size_t hostIdx,
+                                                          u32 seq) {
+    auto &backlog = peers_[hostIdx].backlog;
+    if (!backlog.empty() && seq - backlog.front().seq < backlog.size()) {
+        return &backlog[seq - backlog.front().seq];
+    }
+    return sent_[hostIdx].find(seq);
+}
+template <typename Payload> void Proxy<Payload>::admit(size_t hostIdx) {
+    auto &sent = sent_[hostIdx];
+    auto &peer = peers_[hostIdx];
+    auto &backlog = peer.backlog;
+    u32 from = sent.end();
+
+    while (!backlog.empty() && sent.end() - sent.begin() < MAX_SPAN &&
+           peer.bytes <= budget_) {
+        size_t bytes = held(backlog.front());
+        peer.backlogBytes -= bytes;
+        peer.bytes += bytes;
+
+        push(hostIdx, backlog.front());
+        backlog.pop_front();
+    }
+
+    if (sent.end() != from) {
+        innerSend(hostIdx, from);
+    }
+}
+
+template <typename Payload> void Proxy<Payload>::retransmit(size_t hostIdx) {
+    innerSend(hostIdx, sent_[hostIdx].begin(), true);
+}
+
+template <typename Payload> void Proxy<Payload>::checkRetransmissions() {
+    auto now = Clock::now();
+
+    for (size_t hostIdx = 0; hostIdx < config.hosts().size(); hostIdx++) {
+        auto &peer = peers_[hostIdx];
+
+        if (sent_[hostIdx].empty() || now < peer.nextRetransmit) {
+            continue;
+        }
+
+        if (peer.lastHeard < peer.lastRetransmit) {
+            peer.backoff = std::min(peer.backoff * 2, MAX_BACKOFF);
+
+            // What it is owed past the budget may go now.
+            if (silent(hostIdx) && overBudget(hostIdx)) {
+                compact(hostIdx);
             }
+        }
+
+        // The acks of resent messages cannot tell which copy they answer, so
+        // the timeout stays doubled until one sent once gets acked.
+        peer.timeout = std::min(peer.timeout * 2, MAX_TIMEOUT);
+        peer.backoff = std::max(peer.backoff, peer.timeout);
 
-            std::vector<ToSend> messages(sent_[hostIdx].size());
+        trace(TraceEvent::RETRANSMIT, static_cast<u32>(hostIdx + 1),
+              static_cast<u32>(sent_[hostIdx].size()),
+              static_cast<u32>(peer.backoff.count() / 1000000));
+        retransmit(hostIdx);
+
+        peer.lastRetransmit = now;
+        peer.nextRetransmit = now + peer.backoff;
+        peer.round++;
+    }
+}
+
+template <typename Payload> void Proxy<Payload>::heard(size_t hostIdx) {
+    auto &peer = peers_[hostIdx];
+    peer.lastHeard = Clock::now();
+
+    if (peer.backoff > peer.timeout) {
+        peer.backoff = peer.timeout;
+        peer.nextRetransmit = peer.lastHeard;
+    }
+}
 
-            size_t i = 0;
-            for (const auto &entry : sent_[hostIdx]) {
-                messages[i] = entry.second;
-                i++;
+template <typename Payload>
+void Proxy<Payload>::sampleRtt(size_t hostIdx, Clock::duration rtt) {
+    auto &peer = peers_[hostIdx];
+
+    if (peer.rtt == Clock::duration::zero()) {
+        peer.rtt = rtt;
+        peer.rttVar = rtt / 2;
+    } else {
+        auto deviation = rtt > peer.rtt ? rtt - peer.rtt : peer.rtt - rtt;
+        peer.rttVar = (3 * peer.rttVar + deviation) / 4;
+        peer.rtt = (7 * peer.rtt + rtt) / 8;
+    }
+
+    peer.timeout = std::min(std::max(peer.rtt + 4 * peer.rttVar, TIMEOUT),
+                            MAX_TIMEOUT);
+    peer.backoff = std::max(peer.backoff, peer.timeout);
+}
+
+template <typename Payload>
+void Proxy<Payload>::innerSend(size_t hostIdx, u32 from, bool retransmission) {
+    const Host &host = config.host(hostIdx + 1);
+    u32 round = peers_[hostIdx].round;
+    u8 *buffer = scratch_.data();
+    size_t size = 0;
+    int count = 0;
+    bool fragmentResent = false;
+    auto now = Clock::now();
+
+    sent_[hostIdx].forEach(from, [&](ToSend &message) {
+        if (message.queued || (retransmission && message.round == round)) {
+            return;
+        }
+        if (retransmission && fragmented(message)) {
+            if (fragmentResent) {
+                return;
             }
+            fragmentResent = true;
+        }
+        message.round = round;
+        message.resent = message.resent || retransmission;
+        message.sent = now;
+        size_t length = recordSize(message);
+
+        if (count == 8 || size + length > UDP_PACKET_MAX_SIZE) {
+            size = appendAcks(buffer, size, hostIdx);
+            socket.sendTo(buffer, size, host);
+            size = 0;
+            count = 0;
+        }
+
+        size += serialize(message, buffer + size);
+        count++;
+    });
+
+    if (count > 0) {
+        size = appendAcks(buffer, size, hostIdx);
+        socket.sendTo(buffer, size, host);
+    }
+}
+
+template <typename Payload>
+void Proxy<Payload>::transmit(size_t hostIdx, ToSend &message) {
+    message.round = peers_[hostIdx].round;
+    message.sent = Clock::now();
+    size_t size = serialize(message, scratch_.data());
 
-            innerSend(messages, config.host(hostIdx + 1));
+    size = appendAcks(scratch_.data(), size, hostIdx);
+    socket.sendTo(scratch_.data(), size, config.host(hostIdx + 1));
+}
+
+template <typename Payload>
+void Proxy<Payload>::releaseFragment(size_t hostIdx) {
+    auto &peer = peers_[hostIdx];
+    peer.fragmentsInFlight--;
+
+    // The others are still on their way rather than lost.
+    peer.nextRetransmit =
+        std::max(peer.nextRetransmit, Clock::now() + peer.backoff);
+
+    while (!peer.queued.empty() &&
+           peer.fragmentsInFlight < fragmentWindow_) {
+        ToSend *entry = sent_[hostIdx].find(peer.queued.front());
+        peer.queued.pop_front();
+        if (entry == nullptr) {
+            continue;
         }
-        lastSend_ = Clock::now();
+
+        entry->queued = false;
+        peer.fragmentsInFlight++;
+        transmit(hostIdx, *entry);
     }
+}
 
-    size_t size = socket.recvFrom(buffer, UDP_PACKET_MAX_SIZE, host);
-    size_t processedBytes = 0;
+template <typename Payload>
+void Proxy<Payload>::queueAck(const Ack &ack, size_t hostIdx, bool now) {
+    auto &acks = pendingAcks_[hostIdx];
+    if (now) {
+        ackSince_[hostIdx] = Clock::time_point();
+    } else if (acks.empty()) {
+        ackSince_[hostIdx] = Clock::now();
+    }
+    acks.push_back(ack.seq);
+}
 
-    if (size > 0) {
-        u8 acks[8 * ACK_SIZE];
-        size_t acksSize = 0;
+template <typename Payload>
+size_t Proxy<Payload>::appendAcks(u8 *buff, size_t size, size_t hostIdx) {
+    auto &acks = pendingAcks_[hostIdx];
 
-        host.id = static_cast<u32>(std::find_if(config.hosts().begin(),
-                                                config.hosts().end(),
-                                                [&](const Host &e) {
-                                                    return e.ip == host.ip &&
-                                                           e.port == host.port;
-                                                }) -
-                                   config.hosts().begin()) +
-                  1;
+    size_t count =
+        std::min(acks.size(), (UDP_PACKET_MAX_SIZE - size) / ACK_SIZE);
+    for (size_t i = acks.size() - count; i < acks.size(); ++i) {
+        size += serialize(Ack{acks[i]}, buff + size);
+    }
+    acks.resize(acks.size() - count);
 
-        while (size > processedBytes) {
-            processedBytes += handleMessage(buffer + processedBytes, host,
-                                            acks + acksSize, acksSize);
+    // The acks left over get a full delay of their own to catch a ride.
+    if (count > 0) {
+        ackSince_[hostIdx] = Clock::now();
+    }
+
+    return size;
+}
+
+template <typename Payload> void Proxy<Payload>::flushAcks() {
+    auto now = Clock::now();
+
+    for (size_t hostIdx = 0; hostIdx < config.hosts().size(); hostIdx++) {
+        if (pendingAcks_[hostIdx].empty() ||
+            now - ackSince_[hostIdx] < ACK_DELAY) {
+            continue;
         }
 
-        socket.sendTo(acks, acksSize, host);
+        while (!pendingAcks_[hostIdx].empty()) {
+            size_t size = appendAcks(scratch_.data(), 0, hostIdx);
+            socket.sendTo(scratch_.data(), size, config.host(hostIdx + 1));
+        }
     }
 }
 
 template <typename Payload>
-void Proxy<Payload>::innerSend(const std::vector<ToSend> &payloads,
-                               const Host &host) {
-    u8 buffer[UDP_PACKET_MAX_SIZE];
+void Proxy<Payload>::supersede(size_t hostIdx, u32 seq) {
+    auto tagged = tagged_[hostIdx].find(seq);
+    if (tagged == tagged_[hostIdx].end() || --tagged->second.live > 0) {
+        return;
+    }
+    tagged_[hostIdx].erase(tagged);
+
+    // The receiver could not tell that the rest of a fragmented message is
+    // gone, so those are always sent in full.
+    ToSend *entry = findSent(hostIdx, seq);
+    if (entry == nullptr || fragmented(*entry) ||
+        (entry->body == nullptr && !entry->compacted)) {
+        return;
+    }
 
-    for (auto it = payloads.begin(); it != payloads.end();) {
-        size_t size = 0;
-        for (int i = 0; i < 8 && it != payloads.end(); ++i) {
+    drop(hostIdx, *entry);
+}
 
-            if (size + it->length > UDP_PACKET_MAX_SIZE) {
-                break;
-            }
+template <typename Payload>
+void Proxy<Payload>::drop(size_t hostIdx, ToSend &message) {
+    heldBytes(hostIdx, message.seq) -= held(message);
+    unref(message.body);
+    message.body = nullptr;
+    uncompact(message);
+
+    if (message.ref != 0 && droppedCallback_) {
+        droppedCallback_(message.ref);
+    }
+}
 
-            memcpy(buffer + size, it->message, it->length);
+template <typename Payload> void Proxy<Payload>::compact(size_t hostIdx) {
+    auto &peer = peers_[hostIdx];
+    u32 begin = sent_[hostIdx].begin();
+    u32 seq = static_cast<int32_t>(peer.compacted - begin) > 0
+                  ? peer.compacted
+                  : begin;
+
+    // Once the host is silent, bodies left behind as not compactable are
+    // evicted, from the oldest on.
+    if (silent(hostIdx)) {
+        seq = begin;
+    }
 
-            size += it->length;
-            it++;
+    for (; overBudget(hostIdx) && seq != nextSeq(hostIdx); ++seq) {
+        ToSend *entry = findSent(hostIdx, seq);
+        if (entry == nullptr || entry->body == nullptr) {
+            continue;
         }
 
-        socket.sendTo(buffer, size, host);
+        if (entry->ref != 0 && source_ && source_(entry->ref) != nullptr) {
+            heldBytes(hostIdx, seq) -= held(*entry);
+            unref(entry->body);
+            entry->body = nullptr;
+            entry->compacted = true;
+            compacted_[entry->ref]++;
+        } else if (silent(hostIdx) && !fragmented(*entry)) {
+            drop(hostIdx, *entry);
+            stats.evicted++;
+        }
+    }
+    peer.compacted = seq;
+}
+
+template <typename Payload>
+void Proxy<Payload>::uncompact(ToSend &message) {
+    if (!message.compacted) {
+        return;
+    }
+    message.compacted = false;
+
+    auto it = compacted_.find(message.ref);
+    if (--it->second == 0) {
+        compacted_.erase(it);
+        release_(message.ref);
     }
 }
 
 template <typename Payload>
-size_t Proxy<Payload>::serialize(const Message &msg, u8 *buff) {
-    size_t size = 5;
+typename Proxy<Payload>::Body *Proxy<Payload>::regenerate(ToSend &message) {
+    if (regenerated_ == nullptr || regeneratedRef_ != message.ref) {
+        unref(regenerated_);
+        regenerated_ = nullptr;
+
+        const Payload *p = source_(message.ref);
+        if (p != nullptr) {
+            regenerated_ = encode(*p);
+            regenerated_->refs++;
+            regeneratedRef_ = message.ref;
+        }
+    }
+
+    if (regenerated_ == nullptr || regenerated_->length != message.length) {
+        // The source let go of it early: lost to the host, like an eviction.
+        uncompact(message);
+        stats.evicted++;
+        return nullptr;
+    }
+    return regenerated_;
+}
+
+template <typename Payload>
+void Proxy<Payload>::untag(size_t hostIdx, u32 seq) {
+    auto tagged = tagged_[hostIdx].find(seq);
+    if (tagged == tagged_[hostIdx].end()) {
+        return;
+    }
+
+    for (auto key : tagged->second.keys) {
+        auto it = latest_[hostIdx].find(key);
+        if (it != latest_[hostIdx].end() && it->second.seq == seq) {
+            latest_[hostIdx].erase(it);
+        }
+    }
+    tagged_[hostIdx].erase(tagged);
+}
+
+template <typename Payload>
+size_t Proxy<Payload>::serialize(ToSend &message, u8 *buff) {
+    Body *body = message.compacted ? regenerate(message) : message.body;
+
+    if (body == nullptr) {
+        buff = write_byte(buff, 2);
+        write_u32(buff, message.seq);
+        layerBytes(stats.layerBytesSent, Layer::LINK) += MSG_META_SIZE;
+        return MSG_META_SIZE;
+    }
+
+    if (fragmented(message)) {
+        size_t length = fragmentLength(body->length, message.offset);
+
+        buff = write_byte(buff, 3);
+        buff = write_u32(buff, message.seq);
+        buff = write_u32(buff, static_cast<u32>(body->length));
+        buff = write_u32(buff, message.offset);
+        memcpy(buff, body->data() + message.offset, length);
+
+        layerBytes(stats.layerBytesSent, Layer::LINK) += FRAG_META_SIZE;
+        chargeBody(body->length, length, stats.layerBytesSent);
+        return FRAG_META_SIZE + length;
+    }
 
     buff = write_byte(buff, 0);
-    buff = write_u32(buff, msg.seq);
-    buff = ser(msg.content, buff, size);
+    buff = write_u32(buff, message.seq);
+    memcpy(buff, body->data(), body->length);
 
-    return size;
+    layerBytes(stats.layerBytesSent, Layer::LINK) += MSG_META_SIZE;
+    chargeBody(body->length, body->length, stats.layerBytesSent);
+    return MSG_META_SIZE + body->length;
+}
+template <typename Payload>
+size_t Proxy<Payload>::recordSize(const ToSend &message) {
+    if (message.body == nullptr && !message.compacted) {
+        return MSG_META_SIZE;
+    }
+    if (fragmented(message)) {
+        return FRAG_META_SIZE + fragmentLength(message.length, message.offset);
+    }
+    return MSG_META_SIZE + message.length;
 }
 template <typename Payload>
 size_t Proxy<Payload>::serialize(const Ack &ack, u8 *buff) {
     buff = write_byte(buff, 1);
     buff = write_u32(buff, ack.seq);
 
+    layerBytes(stats.layerBytesSent, Layer::LINK) += ACK_SIZE;
     return ACK_SIZE;
 }
-
 template <typename Payload>
-size_t Proxy<Payload>::handleMessage(u8 *buff, const Host &host, u8 *acks,
-                                     size_t &acksSize) {
+void Proxy<Payload>::chargeBody(size_t total, size_t length, u64 *bytes) {
+    u64 parts[static_cast<size_t>(Layer::COUNT)] = {};
+    chargeWire(static_cast<const Payload *>(nullptr), total, parts);
+
+    for (size_t layer = 0; layer < static_cast<size_t>(Layer::COUNT);
+         ++layer) {
+        bytes[layer] += length == total ? parts[layer]
+                                        : parts[layer] * length / total;
+    }
+}
+template <typename Payload>
+size_t Proxy<Payload>::handleMessage(u8 *buff, size_t available,
+                                     const Host &host) {
+    const u8 *end = buff + available;
     u8 type;
     buff = read_byte(buff, type);
 
-    if (type == 0) {
+    if (type == 0 || type == 2) {
+        if (available < MSG_META_SIZE) {
+            return available;
+        }
+
         Message b;
         size_t processed_size = MSG_META_SIZE;
         buff = read_u32(buff, b.seq);
-        buff = deserialize(b.content, buff, processed_size);
+        if (type == 0) {
+            // Nothing after a body that runs past the datagram can be trusted.
+            buff = deserialize(b.content, buff, end, processed_size);
+            if (buff == nullptr) {
+                return available;
+            }
+            chargeBody(processed_size - MSG_META_SIZE,
+                       processed_size - MSG_META_SIZE,
+                       stats.layerBytesReceived);
+        }
+        layerBytes(stats.layerBytesReceived, Layer::LINK) += MSG_META_SIZE;
 
-        Ack d = Ack{b.seq};
-        acksSize += serialize(d, acks);
+        auto result = received_[host.id - 1].mark(b.seq);
+        if (result == SeqWindow<>::Result::AHEAD) {
+            // Not acked: the sender retries once the window has caught up.
+            return processed_size;
+        }
 
-        auto &deliveredEntry = received_[host.id - 1];
+        queueAck(Ack{b.seq}, host.id - 1);
 
-        if (d.seq < deliveredEntry.lowerBound ||
-            deliveredEntry.delivered.count(d.seq) > 0) {
+        if (result == SeqWindow<>::Result::DUPLICATE) {
             return processed_size;
         }
 
-        if (d.seq == deliveredEntry.lowerBound) {
-            deliveredEntry.lowerBound++;
+        if (type == 2) {
+            return processed_size;
+        }
 
-            auto begin = deliveredEntry.delivered.begin();
-            auto it = begin;
+        stats.linkDelivered++;
+        callback_(b, host);
 
-            if (*it == deliveredEntry.lowerBound) {
-                deliveredEntry.lowerBound++;
+        return processed_size;
 
-                it++;
-                while (*it == deliveredEntry.lowerBound) {
-                    deliveredEntry.lowerBound++;
-                    it++;
-                }
+    } else if (type == 3) {
+        if (available < FRAG_META_SIZE) {
+            return available;
+        }
 
-                deliveredEntry.delivered.erase(begin, it);
-            }
-        } else {
-            deliveredEntry.delivered.insert(d.seq);
+        u32 seq, total, offset;
+        buff = read_u32(buff, seq);
+        buff = read_u32(buff, total);
+        buff = read_u32(buff, offset);
+
+        // Nothing after a bogus fragment can be trusted either.
+        if (!validFragment(host.id - 1, seq, total, offset, available)) {
+            return available;
         }
 
-        callback_(b, host);
+        size_t length = fragmentLength(total, offset);
+        size_t processed_size = FRAG_META_SIZE + length;
+
+        layerBytes(stats.layerBytesReceived, Layer::LINK) += FRAG_META_SIZE;
+        chargeBody(total, length, stats.layerBytesReceived);
+
+        auto result = received_[host.id - 1].mark(seq);
+        if (result == SeqWindow<>::Result::AHEAD) {
+            return processed_size;
+        }
+
+        // The sender has only a window of fragments in flight: the next ones
+        // wait for these acks.
+        queueAck(Ack{seq}, host.id - 1, true);
+
+        if (result == SeqWindow<>::Result::NEW) {
+            // Every fragment but the last is FRAGMENT_SIZE long, and they
+            // were given consecutive seqs.
+            u32 first = seq - static_cast<u32>(offset / FRAGMENT_SIZE);
+            reassemble(host, first, total, offset, buff, length);
+        }
 
         return processed_size;
 
     } else {
         Ack b;
         buff = read_u32(buff, b.seq);
+        layerBytes(stats.layerBytesReceived, Layer::LINK) += ACK_SIZE;
+
+        auto &sent = sent_[host.id - 1];
+        ToSend *entry = sent.find(b.seq);
 
-        if (sent_[host.id - 1].count(b.seq) > 0) {
-            auto &entry = sent_[host.id - 1][b.seq];
-            entry.acked = true;
+        if (entry != nullptr && !entry->queued) {
+            bool fragment = fragmented(*entry);
 
-            if (entry.acked) {
-                free(sent_[host.id - 1][b.seq].message);
-                sent_[host.id - 1].erase(b.seq);
+            if (!entry->resent) {
+                sampleRtt(host.id - 1, Clock::now() - entry->sent);
+            }
+            peers_[host.id - 1].bytes -= held(*entry);
+            unref(entry->body);
+            uncompact(*entry);
+            sent.erase(b.seq);
+            untag(host.id - 1, b.seq);
+
+            if (fragment) {
+                releaseFragment(host.id - 1);
             }
         }
 
         return ACK_SIZE;
     }
-}
\ No newline at end of file
+}
+template <typename Payload>
+bool Proxy<Payload>::validFragment(size_t hostIdx, u32 seq, u32 total,
+                                   u32 offset, size_t available) {
+    if (total <= FRAGMENT_SIZE || total > MAX_BODY_SIZE ||
+        offset % FRAGMENT_SIZE != 0 || offset >= total ||
+        FRAG_META_SIZE + fragmentLength(total, offset) > available) {
+        return false;
+    }
+
+    auto &partials = partial_[hostIdx];
+    auto it = partials.find(seq - static_cast<u32>(offset / FRAGMENT_SIZE));
+    return it == partials.end() || it->second.total == total;
+}
+template <typename Payload>
+void Proxy<Payload>::reassemble(const Host &host, u32 first, u32 total,
+                                u32 offset, const u8 *data, size_t length) {
+    auto &partials = partial_[host.id - 1];
+
+    auto it = partials.find(first);
+    if (it == partials.end()) {
+        if (partials.size() >= maxPartials_) {
+            auto stale = std::min_element(
+                partials.begin(), partials.end(),
+                [](const auto &a, const auto &b) {
+                    return a.second.updated < b.second.updated;
+                });
+            recycle(stale->second.buffer);
+            partials.erase(stale);
+        }
+
+        std::vector<u8> buffer;
+        if (!pool_.empty()) {
+            buffer = std::move(pool_.back());
+            pool_.pop_back();
+        }
+        // Pooled buffers only ever grow, so they are zero-filled once.
+        if (buffer.size() < total) {
+            buffer.resize(total);
+        }
+        u32 last = first + static_cast<u32>((total - 1) / FRAGMENT_SIZE);
+        it = partials.insert({first, {std::move(buffer), 0, total, last, {}}})
+                 .first;
+    }
+
+    auto &partial = it->second;
+    memcpy(partial.buffer.data() + offset, data, length);
+    partial.received += length;
+    partial.updated = Clock::now();
+
+    if (partial.received < total) {
+        return;
+    }
+
+    Message b;
+    size_t size = 0;
+    b.seq = first;
+    u8 *body = partial.buffer.data();
+    bool valid = deserialize(b.content, body, body + total, size) != nullptr;
+
+    recycle(partial.buffer);
+    partials.erase(it);
+
+    if (!valid) {
+        return;
+    }
+
+    stats.linkDelivered++;
+    callback_(b, host);
+}
+template <typename Payload>
+void Proxy<Payload>::expirePartials(size_t hostIdx) {
+    auto &partials = partial_[hostIdx];
+    u32 watermark = received_[hostIdx].watermark();
+
+    // Some fragments were skipped: superseded or evicted at the sender.
+    for (auto it = partials.begin(); it != partials.end();) {
+        if (static_cast<int32_t>(watermark - it->second.last) > 0) {
+            recycle(it->second.buffer);
+            it = partials.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+template <typename Payload>
+void Proxy<Payload>::recycle(std::vector<u8> &buffer) {
+    if (pool_.size() < MAX_POOLED) {
+        pool_.push_back(std::move(buffer));
+    }
+}
@@ -0,0 +1,44 @@
+#include <reorder_window.hpp>
+#include <utility>
+
+template <typename T, size_t Size>
+ReorderWindow<T, Size>::ReorderWindow(u32 first)
+    : next_(first), slots_(Size) {}
+
+template <typename T, size_t Size>
+template <typename F>
+void ReorderWindow<T, Size>::push(u32 order, const T &value, F &&cb) {
+    if (order < next_) {
+        return;
+    }
+
+    if (order == next_) {
+        cb(value);
+        next_++;
+        drain(cb);
+    } else if (order - next_ < Size) {
+        slots_[order & MASK] = value;
+    } else {
+        overflow_.insert({order, value});
+    }
+}
+
+template <typename T, size_t Size>
+template <typename F>
+void ReorderWindow<T, Size>::drain(F &&cb) {
+    while (true) {
+        auto &slot = slots_[next_ & MASK];
+
+        if (slot.has_value()) {
+            cb(*slot);
+            slot.reset();
+        } else if (!overflow_.empty() && overflow_.begin()->first == next_) {
+            cb(overflow_.begin()->second);
+            overflow_.erase(overflow_.begin());
+        } else {
+            return;
+        }
+
+        next_++;
+    }
+}
@@ -0,0 +1,51 @@
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <ios>
+#include <iostream>
+
+#include "parser.hpp"
+#include "run.hpp"
+#include "stats.hpp"
+#include "tracelog.hpp"
+#include "udp.hpp"
+
+// Feeds a trace recorded with `--record-trace` through the protocol stack of
+// the process that recorded it, without opening any socket, then reports how
+// fast it was processed. Takes the arguments of the recorded run plus
+// `--replay-trace TRACE`.
+int main(int argc, char **argv) {
+    config.parse(argc, argv);
+
+    if (!config.hasOption("replay-trace")) {
+        std::cerr << "Usage: " << argv[0]
+                  << " --id ID --hosts HOSTS --output OUTPUT CONFIG"
+                  << " --replay-trace TRACE [--OPTION [VALUE]]...\n";
+        return EXIT_FAILURE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    try {
+        run();
+    } catch (const UdpException &e) {
+        if (e.type() != UdpException::Type::TRACE_END) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+    tracelog.close();
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    stats.report(std::cout, elapsed.count());
+
+    std::fstream out(config.outputPath(),
+                     std::ios_base::out | std::ios_base::trunc);
+    writeOutput(out);
+
+    return 0;
+}
@@ -0,0 +1,273 @@
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "agreement.hpp"
+#include "alloc_profile.hpp"
+#include "frb.hpp"
+#include "parser.hpp"
+#include "proxy.hpp"
+#include "run.hpp"
+#include "serde.hpp"
+#include "tracelog.hpp"
+
+// Maximum number of own messages that may be unacknowledged (perfect links)
+// or undelivered (FIFO broadcast) at any time.
+static const u32 WINDOW = 1024;
+
+static u32 done = 0;
+static std::vector<std::set<u32>> results;
+
+static u32 sent = 0;
+static std::vector<std::pair<u32, u32>> deliveries;
+
+// Threads submitting proposals with `--submitters`, and how often they check
+// whether to give up while waiting for decisions.
+static std::vector<std::thread> submitters;
+static std::atomic<bool> stopping(false);
+static const auto SUBMITTER_POLL = std::chrono::milliseconds(10);
+
+// Reads the non-negative integer given with `--name`, if any, into `value`.
+static void numberOption(const std::string &name, long &value) {
+    if (!config.hasOption(name)) {
+        return;
+    }
+
+    std::string option = config.option(name);
+    char *end;
+    long parsed = strtol(option.c_str(), &end, 10);
+    if (option.empty() || *end != '\0' || parsed < 0) {
+        std::cerr << "Invalid value for --" << name << ": " << option << "\n";
+        return;
+    }
+    value = parsed;
+}
+
+// The bytes each link may hold for a host before it compacts them, from
+// `--peer-budget`.
+static size_t peerBudget() {
+    long budget = Proxy<u32>::DEFAULT_PEER_BUDGET;
+    numberOption("peer-budget", budget);
+    return static_cast<size_t>(budget);
+}
+
+void writeOutput(std::ostream &out) {
+    if (config.mode() == Parser::Mode::LATTICE_AGREEMENT) {
+        for (const auto &result : results) {
+            for (auto elem : result) {
+                out << elem << " ";
+            }
+            out << "\n";
+        }
+        return;
+    }
+
+    for (u32 i = 1; i <= sent; ++i) {
+        out << "b " << i << "\n";
+    }
+    for (const auto &d : deliveries) {
+        out << "d " << d.first << " " << d.second << "\n";
+    }
+}
+
+static void runPerfectLinks() {
+    Proxy<u32> proxy(config.host(), peerBudget());
+    const Host &receiver = config.host(config.receiverId());
+
+    proxy.setCallback([&](Proxy<u32>::Message &msg, const Host &host) {
+        AllocScope scope(AllocTag::APP);
+        deliveries.push_back({static_cast<u32>(host.id), msg.content});
+    });
+
+    if (config.id() != config.receiverId()) {
+        proxy.setTickCallback([&]() {
+            AllocScope scope(AllocTag::APP);
+            while (sent < config.messages() &&
+                   proxy.inFlight(receiver) < WINDOW) {
+                std::vector<u32> batch;
+                while (batch.size() < 8 && sent < config.messages()) {
+                    batch.push_back(++sent);
+                }
+                proxy.send(batch, receiver);
+            }
+        });
+    }
+
+    proxy.wait();
+}
+
+static void runFifoBroadcast() {
+    FifoProxy<std::monostate> proxy(config.host(), peerBudget());
+    u32 ownDelivered = 0;
+
+    // `--bundle-size N` payloads at most go in a URB bundle, which waits for
+    // at most `--bundle-latency US` microseconds to fill up.
+    long bundleSize = BroadcastProxy<std::monostate>::DEFAULT_BUNDLE_SIZE;
+    long bundleLatency = 0;
+    numberOption("bundle-size", bundleSize);
+    numberOption("bundle-latency", bundleLatency);
+    proxy.setBundling(static_cast<size_t>(bundleSize),
+                      std::chrono::microseconds(bundleLatency));
+
+    proxy.setCallback([&](const FifoProxy<std::monostate>::Message &msg) {
+        AllocScope scope(AllocTag::APP);
+        deliveries.push_back({msg.content.host, msg.content.order});
+
+        if (msg.content.host == config.id()) {
+            ownDelivered++;
+        }
+    });
+
+    proxy.setTickCallback([&]() {
+        AllocScope scope(AllocTag::APP);
+        if (sent < config.messages() && sent - ownDelivered < WINDOW) {
+            u32 count = std::min(config.messages() - sent,
+                                 WINDOW - (sent - ownDelivered));
+            proxy.broadcast(std::vector<std::monostate>(count));
+            sent += count;
+        }
+    });
+
+    proxy.wait();
+}
+
+// Submits every `step`-th proposal from `first` on, then waits for them to
+// be decided, or for stopSubmitters().
+static void submitProposals(Agreement &agreement, size_t first, size_t step) {
+    // Signals go to the loop thread, whose handler joins this one.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::vector<std::future<std::set<u32>>> decided;
+    for (size_t i = first; i < config.proposals().size(); i += step) {
+        decided.push_back(
+            agreement.submit(config.proposals()[i], static_cast<u32>(i)));
+    }
+
+    for (auto &d : decided) {
+        while (d.wait_for(SUBMITTER_POLL) != std::future_status::ready) {
+            if (stopping) {
+                return;
+            }
+        }
+        try {
+            d.get();
+        } catch (const std::exception &e) {
+            std::cerr << "Submission failed: " << e.what() << "\n";
+        }
+    }
+}
+
+static void runLatticeAgreement() {
+    results.resize(config.proposals().size());
+
+    Agreement agreement(config.host(), config.proposals().size(),
+                        peerBudget());
+
+    agreement.setCallback([&](u32 lattice_idx, const std::set<u32> &proposal) {
+        AllocScope scope(AllocTag::APP);
+        results[lattice_idx] = proposal;
+
+        done++;
+        if (done == results.size()) {
+            std::cout << "Done !" << std::endl;
+        }
+    });
+
+    // With `--submitters N`, N threads submit the proposals while the event
+    // loop runs, instead of it proposing them all before it starts.
+    long threads = 0;
+    numberOption("submitters", threads);
+
+    if (threads == 0) {
+        for (size_t i = 0; i < config.proposals().size(); ++i) {
+            agreement.propose(config.proposals()[i], static_cast<u32>(i));
+        }
+    }
+    for (long t = 0; t < threads; ++t) {
+        submitters.emplace_back(submitProposals, std::ref(agreement),
+                                static_cast<size_t>(t),
+                                static_cast<size_t>(threads));
+    }
+
+    // The loop only returns through an exception, and the submitters must
+    // not outlive `agreement`.
+    try {
+        agreement.wait();
+    } catch (...) {
+        stopSubmitters();
+        throw;
+    }
+}
+
+void stopSubmitters() {
+    stopping = true;
+    for (auto &t : submitters) {
+        t.join();
+    }
+    submitters.clear();
+}
+
+// Pins the calling thread, which runs the event loop, to `cpu`.
+static void pin(const std::string &cpu) {
+    char *end;
+    long idx = strtol(cpu.c_str(), &end, 10);
+    if (*end != '\0' || idx < 0 || idx >= CPU_SETSIZE) {
+        std::cerr << "Invalid CPU for the event loop: " << cpu << "\n";
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(static_cast<size_t>(idx), &set);
+
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error != 0) {
+        std::cerr << "Could not pin the event loop to CPU " << cpu << ": "
+                  << strerror(error) << "\n";
+    }
+}
+
+void run() {
+    if (config.hasOption("tracelog")) {
+        tracelog.open(config.option("tracelog"));
+    }
+
+    // After the trace log has started its own thread, which should not share
+    // the loop's CPU.
+    if (!config.option("busy-poll").empty()) {
+        pin(config.option("busy-poll"));
+    }
+
+    switch (config.mode()) {
+        case Parser::Mode::PERFECT_LINKS:
+            runPerfectLinks();
+            break;
+        case Parser::Mode::FIFO_BROADCAST:
+            runFifoBroadcast();
+            break;
+        case Parser::Mode::LATTICE_AGREEMENT:
+            runLatticeAgreement();
+            break;
+        default:
+            break;
+    }
+}
@@ -0,0 +1,62 @@
+#include <seq_ring.hpp>
+#include <utility>
+
+template <typename T>
+SeqRing<T>::SeqRing(u32 first, size_t capacity)
+    : begin_(first), end_(first), size_(0), slots_(capacity) {}
+
+template <typename T> void SeqRing<T>::push(const T &value) {
+    if (end_ - begin_ == slots_.size()) {
+        grow();
+    }
+
+    slot(end_++) = value;
+    size_++;
+}
+
+template <typename T> T *SeqRing<T>::find(u32 seq) {
+    if (seq - begin_ >= end_ - begin_) {
+        return nullptr;
+    }
+
+    auto &s = slot(seq);
+    return s.has_value() ? &*s : nullptr;
+}
+
+template <typename T> void SeqRing<T>::erase(u32 seq) {
+    if (seq - begin_ >= end_ - begin_ || !slot(seq).has_value()) {
+        return;
+    }
+
+    slot(seq).reset();
+    size_--;
+
+    while (begin_ != end_ && !slot(begin_).has_value()) {
+        begin_++;
+    }
+}
+
+template <typename T>
+template <typename F>
+void SeqRing<T>::forEach(u32 from, F &&f) {
+    if (static_cast<int32_t>(from - end_) >= 0) {
+        return;
+    }
+    u32 seq = static_cast<int32_t>(from - begin_) >= 0 ? from : begin_;
+
+    for (; seq != end_; ++seq) {
+        auto &s = slot(seq);
+        if (s.has_value()) {
+            f(*s);
+        }
+    }
+}
+
+template <typename T> void SeqRing<T>::grow() {
+    std::vector<std::optional<T>> slots(slots_.size() * 2);
+
+    for (u32 seq = begin_; seq != end_; ++seq) {
+        slots[seq & (slots.size() - 1)] = std::move(slot(seq));
+    }
+    slots_.swap(slots);
+}
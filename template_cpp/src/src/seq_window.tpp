@@ -0,0 +1,35 @@
+#include <seq_window.hpp>
+
+template <size_t Size>
+SeqWindow<Size>::SeqWindow(u32 first) : watermark_(first), bits_(Size / 64) {}
+
+template <size_t Size>
+typename SeqWindow<Size>::Result SeqWindow<Size>::mark(u32 seq) {
+    // Seqs wrap around: those up to 2^31 behind the watermark are old.
+    if (static_cast<int32_t>(seq - watermark_) < 0) {
+        return Result::DUPLICATE;
+    }
+    if (seq - watermark_ >= Size) {
+        return Result::AHEAD;
+    }
+    if (test(seq)) {
+        return Result::DUPLICATE;
+    }
+
+    bits_[(seq & MASK) >> 6] |= u64(1) << (seq & 63);
+
+    // Slide past every delivered seq, a whole word at a time when aligned.
+    while (true) {
+        auto &word = bits_[(watermark_ & MASK) >> 6];
+
+        if ((watermark_ & 63) == 0 && word == ~u64(0)) {
+            word = 0;
+            watermark_ += 64;
+        } else if (test(watermark_)) {
+            word &= ~(u64(1) << (watermark_ & 63));
+            watermark_++;
+        } else {
+            return Result::NEW;
+        }
+    }
+}
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <alloc_profile.hpp>
+#include <iomanip>
+#include <stats.hpp>
+
+Stats stats = Stats();
+
+static size_t bucket(u64 ns) {
+    if (ns < 8) {
+        return static_cast<size_t>(ns);
+    }
+    size_t msb = static_cast<size_t>(63 - __builtin_clzll(ns));
+    return (msb - 2) * 8 + static_cast<size_t>((ns >> (msb - 3)) & 7);
+}
+
+// Largest value that falls into bucket `idx`.
+static u64 bucketBound(size_t idx) {
+    if (idx < 8) {
+        return idx;
+    }
+    size_t msb = idx / 8 + 2;
+    return ((9 + static_cast<u64>(idx % 8)) << (msb - 3)) - 1;
+}
+
+void Histogram::record(u64 ns) {
+    buckets[bucket(ns)]++;
+    count++;
+    max = std::max(max, ns);
+}
+
+u64 Histogram::percentile(double p) const {
+    u64 rank = static_cast<u64>(p * static_cast<double>(count));
+    u64 seen = 0;
+
+    for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); ++i) {
+        seen += buckets[i];
+        if (seen > rank) {
+            return std::min(bucketBound(i), max);
+        }
+    }
+    return max;
+}
+
+static void reportLayer(std::ostream &os, const char *name, u64 delivered,
+                        double seconds) {
+    os << "  " << std::left << std::setw(8) << name << std::right
+       << std::setw(12) << delivered << " delivered" << std::setw(14)
+       << static_cast<double>(delivered) / seconds << " msg/s\n";
+}
+
+static double ratio(u64 n, u64 d) {
+    return d > 0 ? static_cast<double>(n) / static_cast<double>(d) : 0;
+}
+
+static const char *const LAYER_NAMES[] = {"link", "urb", "fifo", "lattice",
+                                          "app"};
+
+static_assert(sizeof(LAYER_NAMES) / sizeof(LAYER_NAMES[0]) ==
+                  static_cast<size_t>(Layer::COUNT),
+              "every layer needs a name");
+
+static void reportWire(std::ostream &os, size_t layer, u64 sent, u64 received,
+                       u64 totalSent, u64 totalReceived) {
+    os << "  " << std::left << std::setw(8) << LAYER_NAMES[layer] << std::right
+       << std::setw(12) << sent << " sent" << std::setw(6)
+       << 100 * ratio(sent, totalSent) << "%" << std::setw(14) << received
+       << " received" << std::setw(6) << 100 * ratio(received, totalReceived)
+       << "%\n";
+}
+
+static void reportAllocations(std::ostream &os, AllocTag tag, u64 delivered,
+                              u64 datagrams) {
+    AllocCounters c = allocCounters(tag);
+    os << "  " << std::left << std::setw(8) << allocTagName(tag) << std::right
+       << std::setw(10) << c.allocations << " allocs" << std::setw(8)
+       << ratio(c.allocations, delivered) << " /delivery" << std::setw(8)
+       << ratio(c.allocations, datagrams) << " /datagram" << std::setw(11)
+       << c.peakBytes << "B peak\n";
+}
+
+void Stats::report(std::ostream &os, double seconds) const {
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+
+    os << std::fixed << std::setprecision(1);
+    os << "Statistics over " << seconds << "s:\n";
+
+    reportLayer(os, "links", linkDelivered, seconds);
+    reportLayer(os, "urb", urbDelivered, seconds);
+    reportLayer(os, "fifo", fifoDelivered, seconds);
+    reportLayer(os, "lattice", decided, seconds);
+
+    os << "  sent     " << std::setw(12) << datagramsSent << " datagrams"
+       << std::setw(14) << bytesSent << " bytes ("
+       << static_cast<double>(bytesSent) / seconds / 1e6 << " MB/s)\n";
+    os << "  received " << std::setw(12) << datagramsReceived << " datagrams"
+       << std::setw(14) << bytesReceived << " bytes ("
+       << static_cast<double>(bytesReceived) / seconds / 1e6 << " MB/s)\n";
+    if (sendErrors > 0) {
+        os << "  failed   " << std::setw(12) << sendErrors << " datagrams\n";
+    }
+    if (evicted > 0) {
+        os << "  evicted  " << std::setw(12) << evicted << " messages\n";
+    }
+
+    os << "Bytes on the wire by layer:\n";
+    for (size_t layer = 0; layer < static_cast<size_t>(Layer::COUNT);
+         ++layer) {
+        reportWire(os, layer, layerBytesSent[layer], layerBytesReceived[layer],
+                   bytesSent, bytesReceived);
+    }
+
+    if (receiveLatency.count > 0) {
+        os << "  receive latency  p50 "
+           << static_cast<double>(receiveLatency.percentile(0.5)) / 1e3
+           << "us  p99 "
+           << static_cast<double>(receiveLatency.percentile(0.99)) / 1e3
+           << "us  max " << static_cast<double>(receiveLatency.max) / 1e3
+           << "us\n";
+    }
+
+    if (allocProfiled()) {
+        // Every layer is charged per message the application got, whatever
+        // the layers underneath batch or split it into, and per datagram.
+        u64 delivered = decided > 0        ? decided
+                        : fifoDelivered > 0 ? fifoDelivered
+                        : urbDelivered > 0  ? urbDelivered
+                                            : linkDelivered;
+        u64 datagrams = datagramsSent + datagramsReceived;
+
+        os << "Allocations:\n";
+        for (size_t tag = 0; tag < static_cast<size_t>(AllocTag::COUNT);
+             ++tag) {
+            reportAllocations(os, static_cast<AllocTag>(tag), delivered,
+                              datagrams);
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#include <trace.hpp>
+#include <udp.hpp>
+
+#include <cstring>
+
+TraceWriter::TraceWriter(const std::string &path)
+    : file_(fopen(path.c_str(), "wb")), buffer_(1 << 20) {
+    if (file_ == nullptr) {
+        perror("Could not open trace");
+        throw UdpException(UdpException::Type::TRACE);
+    }
+
+    setvbuf(file_, buffer_.data(), _IOFBF, buffer_.size());
+    fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), file_);
+}
+TraceWriter::~TraceWriter() { fclose(file_); }
+
+void TraceWriter::record(Clock::time_point t, const Host &from,
+                         const void *data, size_t size) {
+    u8 header[TRACE_HEADER_SIZE];
+
+    u64 time = static_cast<u64>(t.time_since_epoch().count());
+
+    u8 *buff = write_u64(header, time);
+    buff = write_u32(buff, from.ip);
+    write_u32(buff, static_cast<u32>(from.port) << 16 | static_cast<u32>(size));
+
+    fwrite(header, 1, TRACE_HEADER_SIZE, file_);
+    fwrite(data, 1, size, file_);
+}
+
+TraceReader::TraceReader(const std::string &path)
+    : file_(fopen(path.c_str(), "rb")) {
+    char magic[sizeof(TRACE_MAGIC)];
+
+    if (file_ == nullptr ||
+        fread(magic, 1, sizeof(magic), file_) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        perror("Could not open trace");
+        throw UdpException(UdpException::Type::TRACE);
+    }
+
+    u8 header[TRACE_HEADER_SIZE];
+    if (fread(header, 1, TRACE_HEADER_SIZE, file_) == TRACE_HEADER_SIZE) {
+        u64 time;
+        read_u64(header, time);
+        start_ = Clock::time_point(Clock::duration(time));
+    }
+    fseek(file_, sizeof(TRACE_MAGIC), SEEK_SET);
+}
+TraceReader::~TraceReader() { fclose(file_); }
+
+bool TraceReader::next(Clock::time_point &t, Host &from, void *buffer,
+                       size_t &size) {
+    u8 header[TRACE_HEADER_SIZE];
+    if (fread(header, 1, TRACE_HEADER_SIZE, file_) != TRACE_HEADER_SIZE) {
+        return false;
+    }
+
+    u64 time;
+    u32 portAndSize;
+    u8 *buff = read_u64(header, time);
+    buff = read_u32(buff, from.ip);
+    read_u32(buff, portAndSize);
+
+    t = Clock::time_point(Clock::duration(time));
+    from.port = static_cast<unsigned short>(portAndSize >> 16);
+    size = portAndSize & 0xffff;
+
+    return fread(buffer, 1, size, file_) == size;
+}
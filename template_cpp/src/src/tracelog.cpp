@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <chrono>
+#include <clock.hpp>
+#include <iostream>
+#include <tracelog.hpp>
+
+TraceLog tracelog;
+
+static const char *const NAMES[] = {
+    "propose",      "proposal-received", "ack-sent",   "nack-sent",
+    "ack-received", "nack-received",     "decide",     "retransmit",
+    "decision-adopted",
+};
+
+static const char *const ARGS[][5] = {
+    {"instance", "number", "size", nullptr, nullptr},
+    {"instance", "number", "from", "order", "size"},
+    {"instance", "number", "to", nullptr, nullptr},
+    {"instance", "number", "to", "accepted", nullptr},
+    {"instance", "number", "from", nullptr, nullptr},
+    {"instance", "number", "from", "size", nullptr},
+    {"instance", "number", "size", nullptr, nullptr},
+    {"host", "messages", "backoff-ms", nullptr, nullptr},
+    {"instance", "number", "from", "size", nullptr},
+};
+
+static_assert(sizeof(NAMES) / sizeof(NAMES[0]) ==
+                  static_cast<size_t>(TraceEvent::COUNT),
+              "every trace event needs a name");
+static_assert(sizeof(ARGS) / sizeof(ARGS[0]) ==
+                  static_cast<size_t>(TraceEvent::COUNT),
+              "every trace event needs argument names");
+
+const char *traceEventName(TraceEvent event) {
+    if (event >= TraceEvent::COUNT) {
+        return "unknown";
+    }
+    return NAMES[static_cast<size_t>(event)];
+}
+
+const char *const *traceEventArgs(TraceEvent event) {
+    static const char *const none[5] = {nullptr};
+    if (event >= TraceEvent::COUNT) {
+        return none;
+    }
+    return ARGS[static_cast<size_t>(event)];
+}
+
+TraceLog::~TraceLog() { close(); }
+
+void TraceLog::open(const std::string &path) {
+    file_ = fopen(path.c_str(), "wb");
+    if (file_ == nullptr) {
+        perror("Could not open trace log");
+        return;
+    }
+    fwrite(TRACELOG_MAGIC, 1, sizeof(TRACELOG_MAGIC), file_);
+
+    drainer_ = std::thread([this]() { run(); });
+    enabled_.store(true);
+}
+
+void TraceLog::close() {
+    if (file_ == nullptr) {
+        return;
+    }
+
+    enabled_.store(false);
+    stopping_.store(true);
+    if (drainer_.joinable()) {
+        drainer_.join();
+    }
+    drain();
+
+    u64 dropped = 0;
+    for (auto &ring : rings_) {
+        dropped += ring->dropped.load();
+    }
+    if (dropped > 0) {
+        std::cerr << "Trace log dropped " << dropped << " records\n";
+    }
+
+    fclose(file_);
+    file_ = nullptr;
+}
+
+TraceLog::Ring &TraceLog::ring() {
+    thread_local Ring *ring = nullptr;
+
+    if (ring == nullptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        rings_.push_back(std::make_unique<Ring>());
+        ring = rings_.back().get();
+        ring->thread = static_cast<uint16_t>(rings_.size() - 1);
+    }
+    return *ring;
+}
+
+void TraceLog::record(TraceEvent event, u32 a0, u32 a1, u32 a2, u32 a3,
+                      u32 a4) {
+    Ring &r = ring();
+
+    size_t head = r.head.load(std::memory_order_relaxed);
+    if (head - r.tail.load(std::memory_order_acquire) == RING_SIZE) {
+        r.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    r.records[head & (RING_SIZE - 1)] = {
+        static_cast<u64>(Clock::now().time_since_epoch().count()),
+        r.thread,
+        event,
+        {a0, a1, a2, a3, a4}};
+    r.head.store(head + 1, std::memory_order_release);
+}
+
+void TraceLog::drain() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (auto &r : rings_) {
+        size_t tail = r->tail.load(std::memory_order_relaxed);
+        size_t head = r->head.load(std::memory_order_acquire);
+
+        while (tail != head) {
+            size_t begin = tail & (RING_SIZE - 1);
+            size_t count = std::min(head - tail, RING_SIZE - begin);
+
+            fwrite(&r->records[begin], sizeof(TraceRecord), count, file_);
+            tail += count;
+        }
+        r->tail.store(tail, std::memory_order_release);
+    }
+}
+
+void TraceLog::run() {
+    while (!stopping_.load()) {
+        drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
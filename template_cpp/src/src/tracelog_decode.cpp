@@ -0,0 +1,58 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "tracelog.hpp"
+
+// Renders a binary trace log written with `--tracelog PATH` as one line per
+// record, timestamped in microseconds since the earliest record. Each thread
+// records to its own ring and the rings are drained one after the other, so
+// the records are sorted by time first.
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " TRACELOG\n";
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    char magic[sizeof(TRACELOG_MAGIC)];
+
+    if (file == nullptr ||
+        fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, TRACELOG_MAGIC, sizeof(magic)) != 0) {
+        std::cerr << argv[1] << ": not a trace log\n";
+        return EXIT_FAILURE;
+    }
+
+    std::vector<TraceRecord> records;
+    TraceRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        records.push_back(record);
+    }
+    fclose(file);
+
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TraceRecord &a, const TraceRecord &b) {
+                         return a.time < b.time;
+                     });
+
+    u64 start = records.empty() ? 0 : records.front().time;
+
+    std::cout << std::fixed << std::setprecision(3);
+    for (const auto &r : records) {
+        std::cout << std::setw(14)
+                  << static_cast<double>(r.time - start) / 1e3 << " ["
+                  << r.thread << "] " << traceEventName(r.event);
+
+        const char *const *args = traceEventArgs(r.event);
+        for (size_t i = 0; i < 5 && args[i] != nullptr; ++i) {
+            std::cout << " " << args[i] << "=" << r.args[i];
+        }
+        std::cout << "\n";
+    }
+
+    return 0;
+}
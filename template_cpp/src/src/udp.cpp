@@ -1,11 +1,19 @@
 #include <fcntl.h>
+#include <poll.h>
 #include <strings.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cerrno>
+#include <cstring>
 #include <cstdio>
+#include <iostream>
+#include <stats.hpp>
+#include <trace.hpp>
 #include <udp.hpp>
+#include <uring.hpp>
 
 UdpException::UdpException(UdpException::Type t) : t(t) {}
 const char *UdpException::what() const noexcept {
@@ -20,12 +28,54 @@ const char *UdpException::what() const noexcept {
             return "UDP ERROR: Unable to send";
         case Type::RECEIVE:
             return "UDP ERROR: Unable to receive";
+        case Type::URING:
+            return "UDP ERROR: io_uring unavailable";
+        case Type::TRACE:
+            return "UDP ERROR: Cannot open trace";
+        case Type::TRACE_END:
+            return "UDP: End of replayed trace";
         default:
             return "UDP ERROR: unknown";
     }
 }
 
-UdpSocket::UdpSocket(const Host &host) {
+static void setOption(int fd, int level, int name, int value,
+                      const char *label) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        perror(label);
+    }
+}
+
+// Forcing the size needs CAP_NET_ADMIN; otherwise it is capped by the
+// net.core.{r,w}mem_max sysctls.
+static void setBufferSize(int fd, int force, int name, int size,
+                          const char *label) {
+    if (setsockopt(fd, SOL_SOCKET, force, &size, sizeof(size)) < 0) {
+        setOption(fd, SOL_SOCKET, name, size, label);
+    }
+}
+
+static int bufferOption(int fd, int name) {
+    int size = 0;
+    socklen_t length = sizeof(size);
+    if (getsockopt(fd, SOL_SOCKET, name, &size, &length) < 0) {
+        perror("getsockopt");
+    }
+    return size;
+}
+
+UdpSocket::UdpSocket(const Host &host)
+    : fd(-1), busyPoll_(config.hasOption("busy-poll")), active_(false) {
+    if (config.hasOption("replay-trace")) {
+        replay_ = std::make_unique<TraceReader>(config.option("replay-trace"));
+        Clock::pin(replay_->start());
+        return;
+    }
+
+    if (config.hasOption("record-trace")) {
+        record_ = std::make_unique<TraceWriter>(config.option("record-trace"));
+    }
+
     fd = socket(AF_INET, SOCK_DGRAM, 0);
     struct sockaddr_in server = {AF_INET, host.port, {host.ip}, {0}};
 
@@ -50,14 +100,84 @@ UdpSocket::UdpSocket(const Host &host) {
         perror("Could not bind");
         throw UdpException(UdpException::Type::BIND);
     }
+
+    setOption(fd, SOL_SOCKET, SO_TIMESTAMPNS, 1, "setsockopt(SO_TIMESTAMPNS)");
+
+    if (busyPoll_) {
+        setOption(fd, SOL_SOCKET, SO_BUSY_POLL, BUSY_POLL_US,
+                  "setsockopt(SO_BUSY_POLL)");
+    }
+    sizeBuffers(fd);
+
+    if (config.option("udp-backend") == "io_uring") {
+        bool sqpoll = config.hasOption("sqpoll");
+
+        try {
+            uring_ = std::make_unique<UringSocket>(fd, sqpoll);
+        } catch (const UdpException &e) {
+            if (sqpoll) {
+                std::cerr << e.what() << ", retrying without SQ polling\n";
+                try {
+                    uring_ = std::make_unique<UringSocket>(fd, false);
+                } catch (const UdpException &) {
+                }
+            }
+
+            if (!uring_) {
+                std::cerr << e.what() << ", falling back to sockets\n";
+            }
+        }
+    }
+}
+UdpSocket::~UdpSocket() {
+    uring_.reset();
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void UdpSocket::sizeBuffers(int socketFd) const {
+    if (busyPoll_) {
+        setBufferSize(socketFd, SO_RCVBUFFORCE, SO_RCVBUF,
+                      BUSY_POLL_BUFFER_SIZE, "setsockopt(SO_RCVBUF)");
+        setBufferSize(socketFd, SO_SNDBUFFORCE, SO_SNDBUF,
+                      BUSY_POLL_BUFFER_SIZE, "setsockopt(SO_SNDBUF)");
+    }
+}
+
+size_t UdpSocket::bufferSize() const {
+    int socketFd = fd;
+    if (replay_) {
+        socketFd = socket(AF_INET, SOCK_DGRAM, 0);
+        sizeBuffers(socketFd);
+    }
+
+    int size = std::min(bufferOption(socketFd, SO_RCVBUF),
+                        bufferOption(socketFd, SO_SNDBUF));
+
+    if (replay_) {
+        close(socketFd);
+    }
+    return static_cast<size_t>(size);
 }
-UdpSocket::~UdpSocket() { close(fd); }
 
 size_t UdpSocket::sendTo(const void *data, size_t size, const Host &host) {
     if (size == 0) {
         return 0;
     }
 
+    stats.datagramsSent++;
+    stats.bytesSent += size;
+    active_ = true;
+
+    if (replay_) {
+        return size;
+    }
+
+    if (uring_) {
+        return uring_->sendTo(data, size, host);
+    }
+
     struct in_addr dest = {0};
 
     struct sockaddr_in server = {AF_INET, host.port, {host.ip}, {0}};
@@ -74,24 +194,94 @@ size_t UdpSocket::sendTo(const void *data, size_t size, const Host &host) {
     return static_cast<size_t>(sent);
 }
 size_t UdpSocket::recvFrom(void *buffer, size_t size, Host &host) {
+    if (replay_) {
+        Clock::time_point t;
+        if (!replay_->next(t, host, buffer, size)) {
+            throw UdpException(UdpException::Type::TRACE_END);
+        }
+        Clock::pin(t);
+
+        stats.datagramsReceived++;
+        stats.bytesReceived += size;
+        return size;
+    }
+
+    if (uring_) {
+        size_t received = uring_->recvFrom(buffer, size, host);
+        if (received > 0) {
+            record(buffer, received, host);
+        }
+        return received;
+    }
+
     struct sockaddr_in server;
-    socklen_t server_len;
-    server_len = sizeof(server);
+    struct iovec iov = {buffer, size};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(struct timespec))];
+
+    struct msghdr msg = {};
+    msg.msg_name = &server;
+    msg.msg_namelen = sizeof(server);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
 
-    auto received =
-        recvfrom(fd, buffer, size, 0,
-                 reinterpret_cast<struct sockaddr *>(&server), &server_len);
+    auto received = recvmsg(fd, &msg, 0);
 
     if (received < 0) {
         if (errno == EAGAIN) {
-            received = 0;
-        } else {
-            throw UdpException(UdpException::Type::RECEIVE);
+            return 0;
         }
+        throw UdpException(UdpException::Type::RECEIVE);
     }
 
     host.ip = server.sin_addr.s_addr;
     host.port = server.sin_port;
 
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+        struct timespec arrived, now;
+        memcpy(&arrived, CMSG_DATA(cmsg), sizeof(arrived));
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        auto ns = (now.tv_sec - arrived.tv_sec) * 1000000000L +
+                  (now.tv_nsec - arrived.tv_nsec);
+        stats.receiveLatency.record(ns > 0 ? static_cast<u64>(ns) : 0);
+    }
+
+    if (received > 0) {
+        record(buffer, static_cast<size_t>(received), host);
+    }
+
     return static_cast<size_t>(received);
+}
+
+void UdpSocket::idle() {
+    bool active = active_;
+    active_ = false;
+
+    if (active || busyPoll_ || replay_) {
+        return;
+    }
+
+    // io_uring consumes datagrams as they arrive, so the socket itself never
+    // polls readable: that backend waits on its completion queue instead.
+    if (uring_) {
+        uring_->wait(IDLE_TIMEOUT_MS);
+        return;
+    }
+
+    struct pollfd pfd = {fd, POLLIN, 0};
+    ::poll(&pfd, 1, IDLE_TIMEOUT_MS);
+}
+
+void UdpSocket::record(const void *buffer, size_t size, const Host &host) {
+    stats.datagramsReceived++;
+    stats.bytesReceived += size;
+    active_ = true;
+
+    if (record_) {
+        record_->record(Clock::now(), host, buffer, size);
+    }
 }
\ No newline at end of file
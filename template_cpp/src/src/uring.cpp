@@ -0,0 +1,402 @@
+#include <stats.hpp>
+#include <uring.hpp>
+#include <udp.hpp>
+
+#ifdef HAVE_IO_URING
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static int ioUringSetup(unsigned entries, struct io_uring_params *p) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                        unsigned flags, const void *arg = nullptr,
+                        size_t argSize = 0) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit,
+                                    minComplete, flags, arg, argSize));
+}
+
+static int ioUringRegister(int fd, unsigned opcode, void *arg,
+                           unsigned count) {
+    return static_cast<int>(
+        syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+// RECVMSG and SENDMSG appeared in Linux 5.3, and probing for them in 5.6:
+// older kernels are not worth telling apart.
+static bool supportsSocketOps(int ringFd) {
+    const unsigned OPS = 256;
+
+    // Room for the probe header, followed by one entry per opcode.
+    std::vector<struct io_uring_probe_op> buffer(
+        sizeof(struct io_uring_probe) / sizeof(struct io_uring_probe_op) +
+        OPS);
+    auto *probe = reinterpret_cast<struct io_uring_probe *>(buffer.data());
+
+    if (ioUringRegister(ringFd, IORING_REGISTER_PROBE, probe, OPS) < 0) {
+        return false;
+    }
+
+    for (unsigned op : {IORING_OP_RECVMSG, IORING_OP_SENDMSG}) {
+        if (op > probe->last_op ||
+            !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename T> static inline T *ringField(void *ring, unsigned offset) {
+    return reinterpret_cast<T *>(static_cast<u8 *>(ring) + offset);
+}
+
+UringSocket::UringSocket(int fd, bool sqpoll)
+    : fd_(fd), ringFd_(-1), sqpoll_(sqpoll), sqRing_(MAP_FAILED),
+      sqRingSize_(0), cqRing_(MAP_FAILED), cqRingSize_(0), sqes_(nullptr),
+      sqesSize_(0), extArg_(false), toSubmit_(0), recvSlots_(RECV_SLOTS),
+      sendSlots_(SEND_SLOTS) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000;
+    }
+
+    ringFd_ = ioUringSetup(ENTRIES, &params);
+    if (ringFd_ < 0) {
+        perror("io_uring_setup");
+        throw UdpException(UdpException::Type::URING);
+    }
+
+    if (!supportsSocketOps(ringFd_)) {
+        release();
+        throw UdpException(UdpException::Type::URING);
+    }
+
+#ifdef IORING_FEAT_EXT_ARG
+    extArg_ = params.features & IORING_FEAT_EXT_ARG;
+#endif
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ringFd_,
+                   static_cast<off_t>(IORING_OFF_SQ_RING));
+    cqRing_ = singleMmap
+                  ? sqRing_
+                  : mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ringFd_,
+                         static_cast<off_t>(IORING_OFF_CQ_RING));
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd_,
+                      static_cast<off_t>(IORING_OFF_SQES));
+
+    if (sqRing_ == MAP_FAILED || cqRing_ == MAP_FAILED || sqes == MAP_FAILED) {
+        perror("io_uring mmap");
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize_);
+        }
+        release();
+        throw UdpException(UdpException::Type::URING);
+    }
+    sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+    sqHead_ = ringField<unsigned>(sqRing_, params.sq_off.head);
+    sqTail_ = ringField<unsigned>(sqRing_, params.sq_off.tail);
+    sqMask_ = ringField<unsigned>(sqRing_, params.sq_off.ring_mask);
+    sqFlags_ = ringField<unsigned>(sqRing_, params.sq_off.flags);
+    sqArray_ = ringField<unsigned>(sqRing_, params.sq_off.array);
+    cqHead_ = ringField<unsigned>(cqRing_, params.cq_off.head);
+    cqTail_ = ringField<unsigned>(cqRing_, params.cq_off.tail);
+    cqMask_ = ringField<unsigned>(cqRing_, params.cq_off.ring_mask);
+    cqes_ = ringField<struct io_uring_cqe>(cqRing_, params.cq_off.cqes);
+
+    // Completions are driven by the ring, a blocking socket lets the kernel
+    // park receives instead of failing them with EAGAIN.
+    int flags = fcntl(fd_, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd_, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+        perror("fcntl(F_SETFL)");
+        release();
+        throw UdpException(UdpException::Type::OPT);
+    }
+
+    for (auto &slot : recvSlots_) {
+        setupSlot(slot);
+    }
+    for (size_t i = 0; i < sendSlots_.size(); ++i) {
+        setupSlot(sendSlots_[i]);
+        freeSends_.push_back(i);
+    }
+
+    // On failure, the plain socket backend takes over the socket, and must
+    // not find it blocking.
+    try {
+        for (size_t i = 0; i < recvSlots_.size(); ++i) {
+            postRecv(i);
+        }
+        submit();
+    } catch (const UdpException &) {
+        fcntl(fd_, F_SETFL, flags);
+        release();
+        throw UdpException(UdpException::Type::URING);
+    }
+}
+
+UringSocket::~UringSocket() { release(); }
+
+void UringSocket::release() {
+    if (sqes_ != nullptr) {
+        munmap(sqes_, sqesSize_);
+        sqes_ = nullptr;
+    }
+    if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_) {
+        munmap(cqRing_, cqRingSize_);
+    }
+    cqRing_ = MAP_FAILED;
+    if (sqRing_ != MAP_FAILED) {
+        munmap(sqRing_, sqRingSize_);
+        sqRing_ = MAP_FAILED;
+    }
+    if (ringFd_ >= 0) {
+        close(ringFd_);
+        ringFd_ = -1;
+    }
+}
+
+void UringSocket::setupSlot(Slot &slot) {
+    slot.buffer.resize(UDP_PACKET_MAX_SIZE);
+    slot.iov = {slot.buffer.data(), slot.buffer.size()};
+
+    memset(&slot.msg, 0, sizeof(slot.msg));
+    slot.msg.msg_name = &slot.addr;
+    slot.msg.msg_namelen = sizeof(slot.addr);
+    slot.msg.msg_iov = &slot.iov;
+    slot.msg.msg_iovlen = 1;
+
+    slot.length = 0;
+}
+
+struct io_uring_sqe *UringSocket::nextSqe() {
+    unsigned tail = *sqTail_;
+    unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+
+    // In-flight operations never exceed the ring size, so the queue only
+    // fills up when the kernel has not yet consumed earlier submissions.
+    while (tail - head >= ENTRIES) {
+        submit();
+        head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    }
+
+    unsigned idx = tail & *sqMask_;
+    struct io_uring_sqe *sqe = &sqes_[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray_[idx] = idx;
+
+    return sqe;
+}
+
+void UringSocket::postRecv(size_t idx) {
+    Slot &slot = recvSlots_[idx];
+    slot.msg.msg_namelen = sizeof(slot.addr);
+
+    struct io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<u64>(&slot.msg);
+    sqe->len = 1;
+    sqe->user_data = idx;
+
+    __atomic_store_n(sqTail_, *sqTail_ + 1, __ATOMIC_RELEASE);
+    toSubmit_++;
+}
+
+void UringSocket::submit() {
+    if (toSubmit_ == 0) {
+        return;
+    }
+
+    if (sqpoll_) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(sqFlags_, __ATOMIC_RELAXED) &
+            IORING_SQ_NEED_WAKEUP) {
+            ioUringEnter(ringFd_, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        }
+        toSubmit_ = 0;
+        return;
+    }
+
+    int submitted = ioUringEnter(ringFd_, toSubmit_, 0, 0);
+    if (submitted < 0) {
+        if (errno == EAGAIN || errno == EBUSY || errno == EINTR) {
+            return;
+        }
+        throw UdpException(UdpException::Type::SEND);
+    }
+    toSubmit_ -= std::min(toSubmit_, static_cast<unsigned>(submitted));
+}
+
+void UringSocket::reap() {
+    unsigned head = *cqHead_;
+    unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe &cqe = cqes_[head & *cqMask_];
+
+        if (cqe.user_data & SEND_TAG) {
+            // Like a dropped datagram, a failed send is recovered by
+            // retransmission.
+            if (cqe.res < 0) {
+                stats.sendErrors++;
+            }
+            freeSends_.push_back(static_cast<size_t>(cqe.user_data & ~SEND_TAG));
+        } else {
+            size_t idx = static_cast<size_t>(cqe.user_data);
+            if (cqe.res < 0) {
+                if (cqe.res != -EAGAIN && cqe.res != -EINTR &&
+                    cqe.res != -ENOBUFS) {
+                    __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+                    throw UdpException(UdpException::Type::RECEIVE);
+                }
+                postRecv(idx);
+            } else {
+                recvSlots_[idx].length = static_cast<size_t>(cqe.res);
+                ready_.push_back(idx);
+            }
+        }
+    }
+
+    __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+}
+
+void UringSocket::waitCompletion() {
+    submit();
+    if (ioUringEnter(ringFd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR) {
+        throw UdpException(UdpException::Type::SEND);
+    }
+    reap();
+}
+
+void UringSocket::wait(int timeoutMs) {
+    submit();
+    if (!ready_.empty() ||
+        __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) != *cqHead_) {
+        return;
+    }
+
+#ifdef IORING_FEAT_EXT_ARG
+    if (extArg_) {
+        struct __kernel_timespec ts = {0, timeoutMs * 1000000ll};
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = reinterpret_cast<u64>(&ts);
+
+        if (ioUringEnter(ringFd_, 0, 1,
+                         IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                         sizeof(arg)) < 0 &&
+            errno != ETIME && errno != EINTR) {
+            throw UdpException(UdpException::Type::RECEIVE);
+        }
+        return;
+    }
+#endif
+
+    // Before Linux 5.11, io_uring_enter() cannot time out, but the ring polls
+    // readable once it holds completions.
+    struct pollfd pfd = {ringFd_, POLLIN, 0};
+    ::poll(&pfd, 1, timeoutMs);
+}
+
+size_t UringSocket::sendTo(const void *data, size_t size, const Host &host) {
+    if (size == 0) {
+        return 0;
+    }
+
+    if (freeSends_.empty()) {
+        reap();
+    }
+    while (freeSends_.empty()) {
+        waitCompletion();
+    }
+
+    size_t idx = freeSends_.back();
+    freeSends_.pop_back();
+
+    Slot &slot = sendSlots_[idx];
+    memcpy(slot.buffer.data(), data, size);
+    slot.iov.iov_len = size;
+    slot.addr = {AF_INET, host.port, {host.ip}, {0}};
+    slot.msg.msg_namelen = sizeof(slot.addr);
+
+    struct io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<u64>(&slot.msg);
+    sqe->len = 1;
+    sqe->user_data = SEND_TAG | idx;
+
+    __atomic_store_n(sqTail_, *sqTail_ + 1, __ATOMIC_RELEASE);
+    toSubmit_++;
+
+    if (toSubmit_ >= SEND_BATCH) {
+        submit();
+    }
+
+    return size;
+}
+
+size_t UringSocket::recvFrom(void *buffer, size_t size, Host &host) {
+    submit();
+    reap();
+
+    if (ready_.empty()) {
+        return 0;
+    }
+
+    size_t idx = ready_.front();
+    ready_.pop_front();
+
+    Slot &slot = recvSlots_[idx];
+    size_t length = std::min(slot.length, size);
+    memcpy(buffer, slot.buffer.data(), length);
+    host.ip = slot.addr.sin_addr.s_addr;
+    host.port = slot.addr.sin_port;
+
+    postRecv(idx);
+
+    return length;
+}
+
+#else
+
+UringSocket::UringSocket(int, bool) {
+    throw UdpException(UdpException::Type::URING);
+}
+UringSocket::~UringSocket() {}
+void UringSocket::release() {}
+
+size_t UringSocket::sendTo(const void *, size_t, const Host &) { return 0; }
+size_t UringSocket::recvFrom(void *, size_t, Host &) { return 0; }
+void UringSocket::submit() {}
+void UringSocket::wait(int) {}
+
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+
+// Minimal assertions for the unit tests: a failed check reports where it
+// failed, and the test exits with a failure once it is done.
+static int failures = 0;
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond       \
+                      << ") failed\n";                                         \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+static inline int report() {
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
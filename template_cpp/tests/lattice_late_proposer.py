@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+
+# Starts one process of a lattice agreement only once the others have
+# decided, and checks that it still decides.
+#
+# Every process proposes a value of its own to every instance, so each
+# acceptor ACKs at most one first-round proposal: at most one of the early
+# processes decides in its first round, and the others have moved on to
+# higher proposal numbers. The late process needs f + 1 replies for its
+# first-round proposal, so acceptors must answer it with its own proposal
+# number, not theirs.
+
+import os, sys
+import signal
+import subprocess
+import tempfile
+import time
+
+PROCESSES = 5
+PROPOSALS = 10
+BASE_PORT = 11310
+TIMEOUT = 30
+
+
+def write_configs(workdir):
+    proposals = {}
+
+    with open(os.path.join(workdir, "hosts"), "w") as hosts:
+        for pid in range(1, PROCESSES + 1):
+            hosts.write("{} localhost {}\n".format(pid, BASE_PORT + pid))
+
+    for pid in range(1, PROCESSES + 1):
+        proposals[pid] = [{i * PROCESSES + pid} for i in range(PROPOSALS)]
+        with open(os.path.join(workdir, "{}.config".format(pid)), "w") as f:
+            f.write("{} 1 {}\n".format(PROPOSALS, PROPOSALS * PROCESSES))
+            for proposal in proposals[pid]:
+                f.write(" ".join(map(str, sorted(proposal))) + "\n")
+
+    return proposals
+
+
+def start(binary, workdir, pid):
+    log = open(os.path.join(workdir, "{}.log".format(pid)), "w")
+    return subprocess.Popen(
+        [binary, "--id", str(pid),
+         "--hosts", os.path.join(workdir, "hosts"),
+         "--output", os.path.join(workdir, "{}.output".format(pid)),
+         os.path.join(workdir, "{}.config".format(pid))],
+        stdout=log, stderr=subprocess.STDOUT)
+
+
+def wait_done(workdir, pids):
+    deadline = time.time() + TIMEOUT
+    done = set()
+    while len(done) < len(pids) and time.time() < deadline:
+        time.sleep(0.2)
+        for pid in pids:
+            with open(os.path.join(workdir, "{}.log".format(pid))) as log:
+                if "Done !" in log.read():
+                    done.add(pid)
+    return len(done) == len(pids)
+
+
+def run(binary, workdir):
+    early = list(range(1, PROCESSES))
+    procs = {pid: start(binary, workdir, pid) for pid in early}
+
+    ok = wait_done(workdir, early)
+    if not ok:
+        print("The first {} processes did not decide within {}s"
+              .format(len(early), TIMEOUT))
+    else:
+        procs[PROCESSES] = start(binary, workdir, PROCESSES)
+        ok = wait_done(workdir, [PROCESSES])
+        if not ok:
+            print("The late process did not decide within {}s"
+                  .format(TIMEOUT))
+
+    for proc in procs.values():
+        proc.send_signal(signal.SIGINT)
+    for proc in procs.values():
+        proc.wait(timeout=TIMEOUT)
+
+    return ok
+
+
+def check(workdir, proposals):
+    decisions = {}
+    for pid in range(1, PROCESSES + 1):
+        with open(os.path.join(workdir, "{}.output".format(pid))) as f:
+            lines = f.read().split("\n")[:PROPOSALS]
+        decisions[pid] = [set(map(int, line.split())) for line in lines]
+
+    ok = True
+    for i in range(PROPOSALS):
+        union = set().union(*(proposals[pid][i] for pid in proposals))
+        for pid in decisions:
+            decided = decisions[pid][i]
+            if not proposals[pid][i] <= decided or not decided <= union:
+                print("Process {}: invalid decision {} for instance {}"
+                      .format(pid, sorted(decided), i))
+                ok = False
+            for other in decisions:
+                theirs = decisions[other][i]
+                if not (decided <= theirs or theirs <= decided):
+                    print("Processes {} and {}: incomparable decisions for "
+                          "instance {}".format(pid, other, i))
+                    ok = False
+    return ok
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: {} DA_PROC".format(sys.argv[0]))
+        return 2
+
+    with tempfile.TemporaryDirectory() as workdir:
+        proposals = write_configs(workdir)
+        if not run(sys.argv[1], workdir):
+            return 1
+        return 0 if check(workdir, proposals) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+
+# Runs lattice agreement between a few processes on localhost, with large
+# proposals and a `--peer-budget` far below what they take in flight, and
+# checks that every instance is still decided: the links may only drop bodies
+# they can encode again, or that a silent peer will never ack.
+
+import os, sys
+import random
+import signal
+import subprocess
+import tempfile
+import time
+
+PROCESSES = 3
+PROPOSALS = 30
+VALUES = 5000
+BASE_PORT = 11320
+BUDGET = 200000
+TIMEOUT = 60
+
+
+def write_configs(workdir):
+    rng = random.Random(33)
+    values = list(range(1, 1000000))
+    proposals = {}
+
+    with open(os.path.join(workdir, "hosts"), "w") as hosts:
+        for pid in range(1, PROCESSES + 1):
+            hosts.write("{} localhost {}\n".format(pid, BASE_PORT + pid))
+
+    for pid in range(1, PROCESSES + 1):
+        proposals[pid] = [set(rng.sample(values, VALUES))
+                          for _ in range(PROPOSALS)]
+        with open(os.path.join(workdir, "{}.config".format(pid)), "w") as f:
+            f.write("{} {} {}\n".format(PROPOSALS, VALUES, len(values)))
+            for proposal in proposals[pid]:
+                f.write(" ".join(map(str, sorted(proposal))) + "\n")
+
+    return proposals
+
+
+def run(binary, workdir):
+    procs = {}
+    for pid in range(1, PROCESSES + 1):
+        log = open(os.path.join(workdir, "{}.log".format(pid)), "w")
+        procs[pid] = subprocess.Popen(
+            [binary, "--id", str(pid),
+             "--hosts", os.path.join(workdir, "hosts"),
+             "--output", os.path.join(workdir, "{}.output".format(pid)),
+             os.path.join(workdir, "{}.config".format(pid)),
+             "--peer-budget", str(BUDGET)],
+            stdout=log, stderr=subprocess.STDOUT)
+
+    deadline = time.time() + TIMEOUT
+    done = set()
+    while len(done) < PROCESSES and time.time() < deadline:
+        time.sleep(0.2)
+        for pid in procs:
+            with open(os.path.join(workdir, "{}.log".format(pid))) as log:
+                if "Done !" in log.read():
+                    done.add(pid)
+
+    for proc in procs.values():
+        proc.send_signal(signal.SIGINT)
+    for proc in procs.values():
+        proc.wait(timeout=TIMEOUT)
+
+    return len(done) == PROCESSES
+
+
+def check(workdir, proposals):
+    decisions = {}
+    for pid in range(1, PROCESSES + 1):
+        with open(os.path.join(workdir, "{}.output".format(pid))) as f:
+            lines = f.read().split("\n")[:PROPOSALS]
+        decisions[pid] = [set(map(int, line.split())) for line in lines]
+
+    ok = True
+    for i in range(PROPOSALS):
+        union = set().union(*(proposals[pid][i] for pid in proposals))
+        for pid in decisions:
+            decided = decisions[pid][i]
+            if not proposals[pid][i] <= decided or not decided <= union:
+                print("Process {}: invalid decision {} for instance {}"
+                      .format(pid, sorted(decided), i))
+                ok = False
+            for other in decisions:
+                theirs = decisions[other][i]
+                if not (decided <= theirs or theirs <= decided):
+                    print("Processes {} and {}: incomparable decisions for "
+                          "instance {}".format(pid, other, i))
+                    ok = False
+    return ok
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("Usage: {} DA_PROC".format(sys.argv[0]))
+        return 2
+
+    with tempfile.TemporaryDirectory() as workdir:
+        proposals = write_configs(workdir)
+        if not run(sys.argv[1], workdir):
+            print("Not every process decided within {}s".format(TIMEOUT))
+            return 1
+        return 0 if check(workdir, proposals) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,275 @@
+#include <proxy.hpp>
+
+#include "check.hpp"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <set>
+#include <string>
+
+// Two proxies on localhost, 1 sending to 2, and a raw socket bound to the
+// address of host 3 to send fragments to 2 by hand, in any order or not at
+// all.
+
+const static int BASE_PORT = 11330;
+const static std::chrono::seconds TIMEOUT(5);
+
+// Opaque payload: its length, then its bytes.
+struct Blob {
+    std::vector<u8> bytes;
+};
+
+static inline u8 *ser(const Blob &blob, u8 *buff, size_t &s) {
+    buff = write_u32(buff, static_cast<u32>(blob.bytes.size()));
+    memcpy(buff, blob.bytes.data(), blob.bytes.size());
+    s += sizeof(u32) + blob.bytes.size();
+    return buff + blob.bytes.size();
+}
+static inline u8 *deserialize(Blob &blob, u8 *buff, const u8 *end,
+                              size_t &s) {
+    u32 length;
+    if (remaining(buff, end) < sizeof(u32)) {
+        return nullptr;
+    }
+    buff = read_u32(buff, length);
+    if (remaining(buff, end) < length) {
+        return nullptr;
+    }
+    blob.bytes.assign(buff, buff + length);
+    s += sizeof(u32) + length;
+    return buff + length;
+}
+static inline size_t serSize(const Blob &blob) {
+    return sizeof(u32) + blob.bytes.size();
+}
+static inline void chargeWire(const Blob *, size_t size, u64 *bytes) {
+    layerBytes(bytes, Layer::APP) += size;
+}
+
+using BlobProxy = Proxy<Blob>;
+
+static Blob blob(size_t length, u8 seed) {
+    Blob blob;
+    for (size_t i = 0; i < length; ++i) {
+        blob.bytes.push_back(static_cast<u8>(i * 31 + seed));
+    }
+    return blob;
+}
+
+static std::vector<u8> encode(const Blob &blob) {
+    std::vector<u8> body(serSize(blob));
+    size_t size = 0;
+    ser(blob, body.data(), size);
+    return body;
+}
+
+static void parseConfig(const std::string &dir) {
+    std::ofstream hosts(dir + "/hosts");
+    for (int id = 1; id <= 3; ++id) {
+        hosts << id << " localhost " << BASE_PORT + id << "\n";
+    }
+    hosts.close();
+    std::ofstream(dir + "/config") << "1 2\n";
+
+    std::vector<std::string> args = {"proxy_fragments_test",
+                                     "--id",
+                                     "1",
+                                     "--hosts",
+                                     dir + "/hosts",
+                                     "--output",
+                                     dir + "/output",
+                                     dir + "/config"};
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    config.parse(static_cast<int>(argv.size()), argv.data());
+}
+
+struct Received {
+    std::vector<Blob> blobs;
+};
+
+// Stands in for host 3, whose proxy would have sent `body` as fragments.
+class FakeHost {
+  public:
+    FakeHost() : fd_(socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) {
+        const Host &host = config.host(3);
+        struct sockaddr_in addr = {AF_INET, host.port, {host.ip}, {0}};
+        bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    }
+    ~FakeHost() { close(fd_); }
+
+    void fragment(u32 first, const std::vector<u8> &body, u32 index) {
+        u32 total = static_cast<u32>(body.size());
+        u32 offset = index * static_cast<u32>(BlobProxy::FRAGMENT_SIZE);
+        size_t length = BlobProxy::fragmentLength(total, offset);
+
+        std::vector<u8> datagram(BlobProxy::FRAG_META_SIZE + length);
+        u8 *buff = write_byte(datagram.data(), 3);
+        buff = write_u32(buff, first + index);
+        buff = write_u32(buff, total);
+        buff = write_u32(buff, offset);
+        memcpy(buff, body.data() + offset, length);
+        send(datagram);
+    }
+
+    void skip(u32 seq) {
+        std::vector<u8> datagram(BlobProxy::MSG_META_SIZE);
+        write_u32(write_byte(datagram.data(), 2), seq);
+        send(datagram);
+    }
+
+    // Acks received so far.
+    std::set<u32> acks() {
+        std::set<u32> acks;
+        u8 buffer[UDP_PACKET_MAX_SIZE];
+        ssize_t size;
+        while ((size = recv(fd_, buffer, sizeof(buffer), 0)) > 0) {
+            for (u8 *buff = buffer; buff < buffer + size;) {
+                u8 type;
+                u32 seq;
+                buff = read_u32(read_byte(buff, type), seq);
+                if (type == 1) {
+                    acks.insert(seq);
+                }
+            }
+        }
+        return acks;
+    }
+
+  private:
+    int fd_;
+
+    void send(const std::vector<u8> &datagram) {
+        const Host &host = config.host(2);
+        struct sockaddr_in addr = {AF_INET, host.port, {host.ip}, {0}};
+        sendto(fd_, datagram.data(), datagram.size(), 0,
+               reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    }
+};
+
+template <typename Done>
+static bool pollUntil(BlobProxy &sender, BlobProxy &receiver, Done done) {
+    auto deadline = std::chrono::steady_clock::now() + TIMEOUT;
+    while (!done()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        sender.poll();
+        receiver.poll();
+    }
+    return true;
+}
+
+static void fragmented(BlobProxy &sender, BlobProxy &receiver,
+                       Received &received) {
+    std::vector<Blob> blobs = {blob(100, 1), blob(300000, 2),
+                               blob(1 << 20, 3), blob(2 << 20, 4)};
+    for (const auto &b : blobs) {
+        sender.send(b, config.host(2));
+    }
+
+    CHECK(pollUntil(sender, receiver, [&] {
+        return received.blobs.size() == blobs.size() &&
+               sender.inFlight(config.host(2)) == 0;
+    }));
+    CHECK(receiver.partials(config.host(1)) == 0);
+
+    std::multiset<std::vector<u8>> sent, delivered;
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        sent.insert(blobs[i].bytes);
+    }
+    for (const auto &b : received.blobs) {
+        delivered.insert(b.bytes);
+    }
+    CHECK(delivered == sent);
+    received.blobs.clear();
+}
+
+static void lostFragment(BlobProxy &sender, BlobProxy &receiver,
+                         Received &received, FakeHost &fake) {
+    Blob lost = blob(2 * BlobProxy::FRAGMENT_SIZE + 1000, 5);
+    std::vector<u8> body = encode(lost);
+
+    // The middle one of three fragments, seqs 1 to 3, goes missing.
+    fake.fragment(1, body, 0);
+    fake.fragment(1, body, 2);
+    receiver.poll();
+    receiver.poll();
+
+    // Fragments are acked without waiting for anything to ride along with.
+    CHECK(fake.acks() == std::set<u32>({1, 3}));
+    CHECK(received.blobs.empty());
+    CHECK(receiver.partials(config.host(3)) == 1);
+
+    fake.fragment(1, body, 1);
+    CHECK(pollUntil(sender, receiver, [&] { return !received.blobs.empty(); }));
+    CHECK(fake.acks() == std::set<u32>({2}));
+    CHECK(received.blobs.size() == 1 && received.blobs[0].bytes == lost.bytes);
+    CHECK(receiver.partials(config.host(3)) == 0);
+    received.blobs.clear();
+}
+
+static void expiredPartial(BlobProxy &sender, BlobProxy &receiver,
+                           Received &received, FakeHost &fake) {
+    std::vector<u8> body = encode(blob(2 * BlobProxy::FRAGMENT_SIZE + 1, 6));
+
+    // Seqs 4 to 6, the last of which the sender skips: superseded, say.
+    fake.fragment(4, body, 0);
+    fake.fragment(4, body, 1);
+    CHECK(pollUntil(sender, receiver, [&] {
+        return receiver.partials(config.host(3)) == 1;
+    }));
+
+    fake.skip(6);
+    CHECK(pollUntil(sender, receiver, [&] {
+        return receiver.partials(config.host(3)) == 0;
+    }));
+
+    // Too late: the partial is gone, and the seq taken.
+    fake.fragment(4, body, 2);
+    CHECK(pollUntil(sender, receiver,
+                    [&] { return fake.acks().count(6) > 0; }));
+    CHECK(received.blobs.empty());
+    CHECK(receiver.partials(config.host(3)) == 0);
+
+    // The link goes on past it.
+    Blob next = blob(BlobProxy::FRAGMENT_SIZE + 1, 7);
+    body = encode(next);
+    fake.fragment(7, body, 1);
+    fake.fragment(7, body, 0);
+    CHECK(pollUntil(sender, receiver, [&] { return !received.blobs.empty(); }));
+    CHECK(received.blobs.size() == 1 && received.blobs[0].bytes == next.bytes);
+}
+
+int main() {
+    char dir[] = "/tmp/proxy_fragments_XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    parseConfig(dir);
+
+    Received received;
+    BlobProxy sender(config.host(1));
+    BlobProxy receiver(config.host(2));
+    FakeHost fake;
+    receiver.setCallback([&](BlobProxy::Message &message, const Host &) {
+        received.blobs.push_back(message.content);
+    });
+
+    fragmented(sender, receiver, received);
+    lostFragment(sender, receiver, received, fake);
+    expiredPartial(sender, receiver, received, fake);
+
+    for (const char *file : {"hosts", "config", "output"}) {
+        unlink((std::string(dir) + "/" + file).c_str());
+    }
+    rmdir(dir);
+    return report();
+}
@@ -0,0 +1,75 @@
+#include <reorder_window.hpp>
+
+#include "check.hpp"
+
+struct Delivered {
+    std::vector<u32> orders;
+
+    void operator()(const u32 &order) { orders.push_back(order); }
+};
+
+static std::vector<u32> range(u32 first, u32 last) {
+    std::vector<u32> orders;
+    for (u32 order = first; order <= last; ++order) {
+        orders.push_back(order);
+    }
+    return orders;
+}
+
+static void inOrder() {
+    ReorderWindow<u32, 4> window;
+    Delivered delivered;
+    for (u32 order = 1; order <= 10; ++order) {
+        window.push(order, order, delivered);
+    }
+    CHECK(delivered.orders == range(1, 10));
+    CHECK(window.next() == 11);
+}
+
+static void outOfOrder() {
+    ReorderWindow<u32, 4> window;
+    Delivered delivered;
+
+    window.push(3, 3, delivered);
+    window.push(2, 2, delivered);
+    window.push(4, 4, delivered);
+    CHECK(delivered.orders.empty());
+    CHECK(window.next() == 1);
+
+    window.push(1, 1, delivered);
+    CHECK(delivered.orders == range(1, 4));
+    CHECK(window.next() == 5);
+
+    // Already delivered.
+    window.push(2, 2, delivered);
+    window.push(4, 4, delivered);
+    CHECK(delivered.orders.size() == 4);
+}
+
+static void overflow() {
+    ReorderWindow<u32, 4> window;
+    Delivered delivered;
+
+    // Orders 5 and up are too far ahead of 1 for the ring.
+    for (u32 order = 10; order >= 2; --order) {
+        window.push(order, order, delivered);
+    }
+    window.push(7, 7, delivered);
+    CHECK(delivered.orders.empty());
+
+    window.push(1, 1, delivered);
+    CHECK(delivered.orders == range(1, 10));
+    CHECK(window.next() == 11);
+
+    // The ring slots are free again.
+    window.push(12, 12, delivered);
+    window.push(11, 11, delivered);
+    CHECK(delivered.orders == range(1, 12));
+}
+
+int main() {
+    inOrder();
+    outOfOrder();
+    overflow();
+    return report();
+}
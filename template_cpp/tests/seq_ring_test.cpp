@@ -0,0 +1,104 @@
+#include <seq_ring.hpp>
+
+#include "check.hpp"
+
+static std::vector<int> values(SeqRing<int> &ring, u32 from) {
+    std::vector<int> seen;
+    ring.forEach(from, [&](int v) { seen.push_back(v); });
+    return seen;
+}
+
+static void pushFindErase() {
+    SeqRing<int> ring(1, 4);
+    for (int v = 1; v <= 4; ++v) {
+        ring.push(v);
+    }
+    CHECK(ring.size() == 4);
+    CHECK(ring.begin() == 1 && ring.end() == 5);
+    CHECK(ring.find(0) == nullptr);
+    CHECK(ring.find(5) == nullptr);
+    CHECK(ring.find(3) != nullptr && *ring.find(3) == 3);
+
+    // Erasing in the middle leaves a hole; erasing the oldest skips it.
+    ring.erase(2);
+    CHECK(ring.find(2) == nullptr);
+    CHECK(ring.begin() == 1);
+    ring.erase(2);
+    CHECK(ring.size() == 3);
+
+    ring.erase(1);
+    CHECK(ring.begin() == 3);
+    CHECK(ring.size() == 2);
+
+    ring.erase(3);
+    ring.erase(4);
+    CHECK(ring.empty());
+    CHECK(ring.begin() == 5 && ring.end() == 5);
+}
+
+static void grow() {
+    SeqRing<int> ring(1, 4);
+    ring.push(1);
+    ring.push(2);
+    ring.erase(1);
+
+    // The live span, not the size, decides when the ring doubles.
+    for (int v = 3; v <= 20; ++v) {
+        ring.push(v);
+    }
+    CHECK(ring.size() == 19);
+    for (u32 seq = 2; seq <= 20; ++seq) {
+        CHECK(ring.find(seq) != nullptr &&
+              *ring.find(seq) == static_cast<int>(seq));
+    }
+}
+
+static void forEach() {
+    SeqRing<int> ring(10, 8);
+    for (int v = 10; v < 16; ++v) {
+        ring.push(v);
+    }
+    ring.erase(10);
+    ring.erase(12);
+
+    CHECK((values(ring, 0) == std::vector<int>{11, 13, 14, 15}));
+    CHECK((values(ring, 13) == std::vector<int>{13, 14, 15}));
+    CHECK(values(ring, 16).empty());
+    CHECK(values(ring, 100).empty());
+}
+
+static void wraparound() {
+    u32 first = 0xfffffffc;
+    SeqRing<int> ring(first, 4);
+    for (int v = 0; v < 12; ++v) {
+        ring.push(v);
+    }
+    CHECK(ring.end() == 8);
+
+    for (int v = 0; v < 12; ++v) {
+        u32 seq = first + static_cast<u32>(v);
+        CHECK(ring.find(seq) != nullptr && *ring.find(seq) == v);
+    }
+    CHECK(ring.find(8) == nullptr);
+    CHECK(ring.find(first - 1) == nullptr);
+
+    // From before begin(), across 2^32, and from past it.
+    CHECK(values(ring, first - 5).size() == 12);
+    CHECK((values(ring, 0xffffffff) ==
+           std::vector<int>{3, 4, 5, 6, 7, 8, 9, 10, 11}));
+    CHECK((values(ring, 6) == std::vector<int>{10, 11}));
+
+    for (u32 seq = first; seq != 4; ++seq) {
+        ring.erase(seq);
+    }
+    CHECK(ring.begin() == 4);
+    CHECK(ring.size() == 4);
+}
+
+int main() {
+    pushFindErase();
+    grow();
+    forEach();
+    wraparound();
+    return report();
+}
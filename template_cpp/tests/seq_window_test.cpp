@@ -0,0 +1,91 @@
+#include <seq_window.hpp>
+
+#include "check.hpp"
+
+using Result = SeqWindow<64>::Result;
+
+static void inOrder() {
+    SeqWindow<64> window;
+    for (u32 seq = 1; seq <= 200; ++seq) {
+        CHECK(window.mark(seq) == Result::NEW);
+        CHECK(window.mark(seq) == Result::DUPLICATE);
+        CHECK(window.watermark() == seq + 1);
+    }
+}
+
+static void outOfOrder() {
+    SeqWindow<64> window;
+    CHECK(window.mark(3) == Result::NEW);
+    CHECK(window.mark(2) == Result::NEW);
+    CHECK(window.watermark() == 1);
+    CHECK(window.mark(3) == Result::DUPLICATE);
+
+    CHECK(window.mark(1) == Result::NEW);
+    CHECK(window.watermark() == 4);
+}
+
+static void wholeWord() {
+    SeqWindow<64> window(64);
+    for (u32 seq = 127; seq > 64; --seq) {
+        CHECK(window.mark(seq) == Result::NEW);
+    }
+    CHECK(window.watermark() == 64);
+
+    CHECK(window.mark(64) == Result::NEW);
+    CHECK(window.watermark() == 128);
+    CHECK(window.mark(191) == Result::NEW);
+    CHECK(window.mark(192) == Result::AHEAD);
+}
+
+static void slide() {
+    SeqWindow<64> window;
+
+    // Only the seqs within Size of the watermark can be recorded.
+    CHECK(window.mark(65) == Result::AHEAD);
+    CHECK(window.mark(64) == Result::NEW);
+    CHECK(window.watermark() == 1);
+
+    for (u32 seq = 1; seq < 64; ++seq) {
+        CHECK(window.mark(seq) == Result::NEW);
+    }
+    CHECK(window.watermark() == 65);
+
+    // The window has moved on: what was ahead fits, and what is behind it
+    // was delivered.
+    CHECK(window.mark(128) == Result::NEW);
+    CHECK(window.mark(129) == Result::AHEAD);
+    CHECK(window.mark(65) == Result::NEW);
+    CHECK(window.mark(10) == Result::DUPLICATE);
+    CHECK(window.mark(64) == Result::DUPLICATE);
+}
+
+static void wraparound() {
+    u32 first = 0xfffffff0;
+    SeqWindow<64> window(first);
+
+    // Past 2^32 but within the window: ahead of the watermark, not behind.
+    CHECK(window.mark(3) == Result::NEW);
+    CHECK(window.mark(first + 63) == Result::NEW);
+    CHECK(window.mark(first + 64) == Result::AHEAD);
+    CHECK(window.watermark() == first);
+
+    for (u32 seq = first; seq != 3; ++seq) {
+        CHECK(window.mark(seq) == Result::NEW);
+    }
+    CHECK(window.watermark() == 4);
+
+    CHECK(window.mark(first) == Result::DUPLICATE);
+    CHECK(window.mark(0xffffffff) == Result::DUPLICATE);
+    CHECK(window.mark(0) == Result::DUPLICATE);
+    CHECK(window.mark(3) == Result::DUPLICATE);
+    CHECK(window.mark(4) == Result::NEW);
+}
+
+int main() {
+    inOrder();
+    outOfOrder();
+    wholeWord();
+    slide();
+    wraparound();
+    return report();
+}
@@ -0,0 +1,90 @@
+#include <set_codec.hpp>
+
+#include "check.hpp"
+
+// Encodes `values`, checks the encoding picked and its size, and decodes it
+// back.
+static void roundTrip(const std::vector<u32> &values, SetEncoding encoding) {
+    std::vector<u8> buffer(set_size(values));
+    u8 *end = write_set(buffer.data(), values);
+    CHECK(end == buffer.data() + buffer.size());
+    CHECK(buffer[0] == encoding);
+
+    std::vector<u32> decoded = {42};
+    size_t s = 0;
+    CHECK(read_set(buffer.data(), end, decoded, s) == end);
+    CHECK(s == buffer.size());
+    CHECK(decoded == values);
+
+    // Any truncated encoding is rejected.
+    for (size_t length = 0; length < buffer.size(); ++length) {
+        size_t ignored = 0;
+        CHECK(read_set(buffer.data(), buffer.data() + length, decoded,
+                       ignored) == nullptr);
+    }
+}
+
+static std::vector<u32> range(u32 first, u32 count, u32 step) {
+    std::vector<u32> values;
+    for (u32 i = 0; i < count; ++i) {
+        values.push_back(first + i * step);
+    }
+    return values;
+}
+
+static void edges() {
+    roundTrip({}, SET_RAW);
+    roundTrip({0}, SET_DELTA);
+    roundTrip({0xffffffff}, SET_RAW);
+    roundTrip({0, 0xffffffff}, SET_DELTA);
+    roundTrip({0, 1, 2, 3, 0xfffffffe, 0xffffffff}, SET_DELTA);
+}
+
+static void dense() {
+    roundTrip(range(0, 1000, 1), SET_BITMAP);
+    roundTrip(range(0, 1000, 3), SET_BITMAP);
+    roundTrip(range(0xffffffff - 999, 1000, 1), SET_BITMAP);
+}
+
+static void sparse() {
+    roundTrip(range(1000, 1000, 100), SET_DELTA);
+    roundTrip(range(0xffffffff - 999 * 1000, 1000, 1000), SET_DELTA);
+    // Gaps past 2^28 take five bytes as varints.
+    roundTrip(range(0x10000000, 15, 0x10000000), SET_RAW);
+}
+
+static void bogus() {
+    std::vector<u32> values;
+    size_t s = 0;
+
+    // A count that no encoding of the bytes left could hold.
+    u8 raw[] = {SET_RAW, 0xff, 0xff, 0xff, 0xff, 0, 0, 0, 1};
+    CHECK(read_set(raw, raw + sizeof(raw), values, s) == nullptr);
+    CHECK(values.empty());
+
+    u8 delta[] = {SET_DELTA, 0, 0, 0, 3, 1, 1};
+    CHECK(read_set(delta, delta + sizeof(delta), values, s) == nullptr);
+
+    // A varint that does not fit a u32.
+    u8 overlong[] = {SET_DELTA, 0, 0, 0, 1, 0x80, 0x80, 0x80, 0x80, 0x80, 0};
+    CHECK(read_set(overlong, overlong + sizeof(overlong), values, s) ==
+          nullptr);
+
+    // A bitmap longer than the message, or with fewer bits than the count.
+    u8 bitmap[] = {SET_BITMAP, 0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 9, 0x01};
+    CHECK(read_set(bitmap, bitmap + sizeof(bitmap), values, s) == nullptr);
+    bitmap[12] = 1;
+    CHECK(read_set(bitmap, bitmap + sizeof(bitmap), values, s) == nullptr);
+    bitmap[13] = 0x11;
+    CHECK(read_set(bitmap, bitmap + sizeof(bitmap), values, s) ==
+          bitmap + sizeof(bitmap));
+    CHECK((values == std::vector<u32>{0, 4}));
+}
+
+int main() {
+    edges();
+    dense();
+    sparse();
+    bogus();
+    return report();
+}